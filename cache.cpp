@@ -0,0 +1,226 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of tarfldr.
+ *
+ * tarfldr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * tarfldr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with tarfldr.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "tarfldr.h"
+
+using namespace std;
+
+// Explorer creates lots of shell_folders for the same archive, so we keep the
+// parsed archives around and share them between all of them.
+
+#define DEFAULT_CACHE_SIZE 256 // MB
+
+tar_info_cache tar_cache;
+
+static u16string get_file_identity(const filesystem::path& fn, file_identity& id) {
+    BY_HANDLE_FILE_INFORMATION bhfi;
+    char16_t buf[MAX_PATH];
+
+    unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
+
+    if (h.get() == INVALID_HANDLE_VALUE)
+        throw last_error("CreateFile", GetLastError());
+
+    if (!GetFileInformationByHandle(h.get(), &bhfi))
+        throw last_error("GetFileInformationByHandle", GetLastError());
+
+    id.volume = bhfi.dwVolumeSerialNumber;
+    id.index = ((uint64_t)bhfi.nFileIndexHigh << 32) | bhfi.nFileIndexLow;
+    id.size = ((uint64_t)bhfi.nFileSizeHigh << 32) | bhfi.nFileSizeLow;
+    id.mtime = ((uint64_t)bhfi.ftLastWriteTime.dwHighDateTime << 32) | bhfi.ftLastWriteTime.dwLowDateTime;
+
+    auto len = GetFinalPathNameByHandleW(h.get(), (WCHAR*)buf, sizeof(buf) / sizeof(char16_t), FILE_NAME_NORMALIZED);
+
+    if (len == 0 || len >= sizeof(buf) / sizeof(char16_t)) // path too long, so fall back to what we were given
+        return fn.u16string();
+
+    return u16string(buf, len);
+}
+
+// Anything a folder is still using stays, as otherwise the next get would
+// scan it all over again, and we'd have two copies in memory. We also always
+// keep the most recently used entry, however big it is.
+
+void tar_info_cache::evict(vector<shared_ptr<tar_info>>& evicted) {
+    if (lru.empty())
+        return;
+
+    auto it = prev(lru.end());
+
+    while (total > budget.value_or(0) && it != lru.begin()) {
+        auto& ent = *it;
+
+        if (ent.second.tar.use_count() > 1) {
+            it--;
+            continue;
+        }
+
+        debug("tar_info_cache: evicting {} ({} bytes)\n", utf16_to_utf8(ent.first), ent.second.size);
+
+        total -= ent.second.size;
+        evicted.emplace_back(move(ent.second.tar));
+        map.erase(ent.first);
+        it = prev(lru.erase(it));
+        evictions++;
+    }
+}
+
+// Archives get added to the cache as soon as their scan has started, so the
+// size we recorded then will be too small. Fix it once the scan is done.
+
+void tar_info_cache::update_sizes() {
+    for (auto& ent : lru) {
+        if (ent.second.sized || !ent.second.tar->scan_finished())
+            continue;
+
+        total -= ent.second.size;
+        ent.second.size = ent.second.tar->memory_usage();
+        ent.second.sized = true;
+        total += ent.second.size;
+    }
+}
+
+// Called by a shell_folder when it's finished with an archive. If nobody else
+// is using it and it's still being scanned, there's no point carrying on - the
+// user might have opened a huge file by mistake. The use_count check is done
+// under the lock, so that get can't hand it out while we're cancelling it.
+
+void tar_info_cache::release(shared_ptr<tar_info>& tar) {
+    shared_ptr<tar_info> cancelled;
+
+    if (!tar)
+        return;
+
+    {
+        lock_guard lg(mutex);
+
+        for (auto it = lru.begin(); it != lru.end(); it++) {
+            if (it->second.tar != tar)
+                continue;
+
+            // one reference for the cache, one for the caller
+
+            if (tar.use_count() == 2 && !tar->scan_finished()) {
+                debug("tar_info_cache: cancelling scan of {}\n", utf16_to_utf8(it->first));
+
+                tar->cancel();
+
+                total -= it->second.size;
+                cancelled = move(it->second.tar);
+                map.erase(it->first);
+                lru.erase(it);
+            }
+
+            break;
+        }
+    }
+
+    // the tar_info waits for its scan thread to stop when it's freed, so do this outside the lock
+
+    tar.reset();
+    cancelled.reset();
+}
+
+void tar_info_cache::set_budget(uint64_t budget) {
+    vector<shared_ptr<tar_info>> evicted;
+
+    {
+        lock_guard lg(mutex);
+
+        this->budget = budget;
+
+        evict(evicted);
+    }
+
+    // evicted entries get freed here, outside the lock
+}
+
+shared_ptr<tar_info> tar_info_cache::get(const filesystem::path& fn) {
+    file_identity id;
+    vector<shared_ptr<tar_info>> evicted;
+
+    auto path = get_file_identity(fn, id);
+
+    {
+        lock_guard lg(mutex);
+
+        // not done in constructor, as we shouldn't touch the registry within DllMain
+
+        if (!budget.has_value())
+            budget = (uint64_t)get_setting(u"CacheSize", DEFAULT_CACHE_SIZE) << 20;
+
+        update_sizes();
+
+        if (auto it = map.find(path); it != map.end()) {
+            // if the scan failed, try again in case it was something transient
+
+            if (it->second->second.id == id && !it->second->second.tar->scan_failed()) {
+                lru.splice(lru.begin(), lru, it->second);
+                hits++;
+
+                debug("tar_info_cache: hit for {} ({} hits, {} misses)\n", utf16_to_utf8(path), hits, misses);
+
+                return it->second->second.tar;
+            }
+
+            // file has changed since we last saw it
+
+            total -= it->second->second.size;
+            evicted.emplace_back(move(it->second->second.tar));
+            lru.erase(it->second);
+            map.erase(it);
+        }
+
+        misses++;
+    }
+
+    evicted.clear();
+
+    // Open the archive outside the lock, so we're not holding up everybody
+    // else. If two threads race to load the same file, the loser's copy gets
+    // thrown away.
+
+    auto tar = make_shared<tar_info>(fn);
+    auto sized = tar->scan_finished();
+    auto size = tar->memory_usage();
+
+    debug("tar_info_cache: miss for {} ({} bytes, {} hits, {} misses)\n", utf16_to_utf8(path), size, hits, misses);
+
+    {
+        lock_guard lg(mutex);
+
+        if (auto it = map.find(path); it != map.end() && it->second->second.id == id && !it->second->second.tar->scan_failed()) {
+            lru.splice(lru.begin(), lru, it->second);
+
+            return it->second->second.tar;
+        } else if (it != map.end()) {
+            total -= it->second->second.size;
+            evicted.emplace_back(move(it->second->second.tar));
+            lru.erase(it->second);
+            map.erase(it);
+        }
+
+        lru.emplace_front(path, tar_info_cache_entry{id, tar, size, sized});
+        map.emplace(path, lru.begin());
+        total += size;
+
+        evict(evicted);
+    }
+
+    return tar;
+}
@@ -0,0 +1,441 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of tarfldr.
+ *
+ * tarfldr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * tarfldr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with tarfldr.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "catalog.h"
+#include <fstream>
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace std;
+
+// File layout:
+//
+// magic (8 bytes), version (u32), CRC32 of rest of file (u32), then
+// key: path, archive size, archive mtime, archive type
+// number of access points, then the access points
+// entries, until end of file
+//
+// All integers after the header are LEB128 varints, signed ones zigzagged.
+// Paths are stored as the length of the prefix shared with the previous path,
+// followed by the rest of the path. Users and groups are stored as an index
+// into a table built up as we go; an index one past the end of the table means
+// that a new string follows. Header offsets are stored relative to the previous
+// one, and data offsets relative to the header offset, plus one so that zero
+// can mean "unknown". Access points are stored as deltas from the previous one.
+
+static const char catalog_magic[] = { 'T', 'F', 'C', 'A', 'T', 'L', 'G', 0 };
+
+#define HEADER_SIZE (sizeof(catalog_magic) + sizeof(uint32_t) + sizeof(uint32_t))
+
+#define ENTRY_DIR           1
+#define ENTRY_HAS_MTIME     2
+
+static void write_varint(string& buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+
+    buf.push_back((char)v);
+}
+
+static void write_svarint(string& buf, int64_t v) {
+    write_varint(buf, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void write_string(string& buf, const string_view& s) {
+    write_varint(buf, s.length());
+    buf.append(s);
+}
+
+static uint64_t read_varint(string_view& sv) {
+    uint64_t v = 0;
+    unsigned int shift = 0;
+
+    do {
+        if (sv.empty() || shift > 63)
+            throw runtime_error("Catalog truncated.");
+
+        auto c = (uint8_t)sv[0];
+
+        sv.remove_prefix(1);
+
+        v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+
+        if (!(c & 0x80))
+            return v;
+    } while (true);
+}
+
+static int64_t read_svarint(string_view& sv) {
+    auto v = read_varint(sv);
+
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static string_view read_string(string_view& sv) {
+    auto len = read_varint(sv);
+
+    if (len > sv.length())
+        throw runtime_error("Catalog truncated.");
+
+    auto s = sv.substr(0, len);
+
+    sv.remove_prefix(len);
+
+    return s;
+}
+
+static void write_u32(char* ptr, uint32_t v) {
+    for (unsigned int i = 0; i < sizeof(uint32_t); i++) {
+        ptr[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static uint32_t read_u32(const char* ptr) {
+    uint32_t v = 0;
+
+    for (unsigned int i = 0; i < sizeof(uint32_t); i++) {
+        v |= (uint32_t)(uint8_t)ptr[i] << (i * 8);
+    }
+
+    return v;
+}
+
+catalog_writer::catalog_writer(const catalog_key& key) {
+    buf.resize(HEADER_SIZE);
+
+    write_string(buf, key.path);
+    write_varint(buf, key.size);
+    write_svarint(buf, key.mtime);
+    write_varint(buf, key.type);
+}
+
+void catalog_writer::add_owner(const string_view& s) {
+    for (size_t i = 0; i < owners.size(); i++) {
+        if (owners[i] == s) {
+            write_varint(entries, i);
+            return;
+        }
+    }
+
+    write_varint(entries, owners.size());
+    write_string(entries, s);
+
+    owners.emplace_back(s);
+}
+
+void catalog_writer::add(const catalog_entry& ent) {
+    size_t prefix = 0;
+
+    while (prefix < last_path.length() && prefix < ent.path.length() && last_path[prefix] == ent.path[prefix]) {
+        prefix++;
+    }
+
+    write_varint(entries, (ent.dir ? ENTRY_DIR : 0) | (ent.mtime.has_value() ? ENTRY_HAS_MTIME : 0));
+    write_varint(entries, prefix);
+    write_string(entries, ent.path.substr(prefix));
+    write_svarint(entries, ent.size);
+
+    // mtimes within an archive tend to be close together, so store them as deltas
+
+    if (ent.mtime.has_value()) {
+        write_svarint(entries, ent.mtime.value() - last_mtime.value_or(0));
+        last_mtime = ent.mtime;
+    }
+
+    write_varint(entries, ent.mode);
+    add_owner(ent.user);
+    add_owner(ent.group);
+
+    write_svarint(entries, ent.header_offset - last_header_offset);
+    write_varint(entries, ent.data_offset < 0 ? 0 : (ent.data_offset - ent.header_offset + 1));
+    last_header_offset = ent.header_offset;
+
+    last_path = ent.path;
+}
+
+void catalog_writer::add_access_point(const catalog_access_point& ap) {
+    write_varint(access_points, ap.in_offset - last_in_offset);
+    write_varint(access_points, ap.out_offset - last_out_offset);
+    write_varint(access_points, ap.bits);
+    write_string(access_points, ap.window);
+
+    last_in_offset = ap.in_offset;
+    last_out_offset = ap.out_offset;
+    num_access_points++;
+}
+
+void catalog_writer::save(const filesystem::path& fn) {
+    write_varint(buf, num_access_points);
+    buf.append(access_points);
+    buf.append(entries);
+
+    memcpy(buf.data(), catalog_magic, sizeof(catalog_magic));
+    write_u32(buf.data() + sizeof(catalog_magic), CATALOG_VERSION);
+    write_u32(buf.data() + sizeof(catalog_magic) + sizeof(uint32_t),
+              crc32(0, (const Bytef*)buf.data() + HEADER_SIZE, (uInt)(buf.length() - HEADER_SIZE)));
+
+    // write to temporary file and rename, so that readers never see a partial catalog
+
+    auto tmp_fn = fn;
+    tmp_fn += ".tmp";
+
+    try {
+        {
+            ofstream f(tmp_fn, ios::binary | ios::trunc);
+
+            if (!f.good())
+                throw runtime_error("Could not open " + tmp_fn.string() + " for writing.");
+
+            f.write(buf.data(), buf.length());
+
+            if (!f.good())
+                throw runtime_error("Error writing " + tmp_fn.string() + ".");
+        }
+
+        // Replace the old catalog in one go, so there's never a moment when
+        // there isn't one. POSIX rename already does this.
+
+#ifdef _WIN32
+        if (!MoveFileExW(tmp_fn.c_str(), fn.c_str(), MOVEFILE_REPLACE_EXISTING))
+            throw runtime_error("Could not move " + tmp_fn.string() + " to " + fn.string() + " (error " + to_string(GetLastError()) + ").");
+#else
+        filesystem::rename(tmp_fn, fn);
+#endif
+    } catch (...) {
+        error_code ec;
+
+        filesystem::remove(tmp_fn, ec);
+        throw;
+    }
+}
+
+// Deletes the least recently used catalogs in dir until what's left adds up to
+// no more than max_size, never touching keep. Temporary files left behind by
+// a crash get deleted once they're an hour old.
+
+void prune_catalogs(const filesystem::path& dir, const filesystem::path& keep, uint64_t max_size) {
+    struct cat_file {
+        filesystem::path fn;
+        uint64_t size;
+        filesystem::file_time_type mtime;
+    };
+
+    vector<cat_file> files;
+    uint64_t total = 0;
+    error_code ec;
+    auto stale = filesystem::file_time_type::clock::now() - chrono::hours(1);
+
+    for (const auto& de : filesystem::directory_iterator(dir, ec)) {
+        if (!de.is_regular_file(ec))
+            continue;
+
+        auto mtime = de.last_write_time(ec);
+
+        if (ec)
+            continue;
+
+        if (de.path().extension() == ".tmp") {
+            if (mtime < stale)
+                filesystem::remove(de.path(), ec);
+
+            continue;
+        }
+
+        if (de.path().extension() != ".cat")
+            continue;
+
+        auto size = de.file_size(ec);
+
+        if (ec)
+            continue;
+
+        total += size;
+
+        if (de.path() != keep)
+            files.emplace_back(de.path(), size, mtime);
+    }
+
+    if (total <= max_size)
+        return;
+
+    sort(files.begin(), files.end(), [](const cat_file& a, const cat_file& b) {
+        return a.mtime < b.mtime;
+    });
+
+    for (const auto& f : files) {
+        if (total <= max_size)
+            break;
+
+        if (filesystem::remove(f.fn, ec))
+            total -= f.size;
+    }
+}
+
+bool load_catalog(const filesystem::path& fn, const catalog_key& key,
+                  const function<void(const catalog_entry&)>& func,
+                  const function<void(const catalog_access_point&)>& access_point_func) {
+    string buf;
+
+    {
+        ifstream f(fn, ios::binary);
+
+        if (!f.good())
+            return false;
+
+        f.seekg(0, ios::end);
+        auto size = (size_t)f.tellg();
+        f.seekg(0, ios::beg);
+
+        if (size < HEADER_SIZE)
+            return false;
+
+        buf.resize(size);
+        f.read(buf.data(), size);
+
+        if (!f.good())
+            return false;
+    }
+
+    // validate header
+
+    if (memcmp(buf.data(), catalog_magic, sizeof(catalog_magic)))
+        return false;
+
+    if (read_u32(buf.data() + sizeof(catalog_magic)) != CATALOG_VERSION)
+        return false;
+
+    if (read_u32(buf.data() + sizeof(catalog_magic) + sizeof(uint32_t)) !=
+        crc32(0, (const Bytef*)buf.data() + HEADER_SIZE, (uInt)(buf.length() - HEADER_SIZE)))
+        return false;
+
+    string_view sv = string_view(buf).substr(HEADER_SIZE);
+
+    // check that the catalog refers to the same version of the same file
+
+    if (read_string(sv) != key.path)
+        return false;
+
+    if (read_varint(sv) != key.size || read_svarint(sv) != key.mtime || read_varint(sv) != key.type)
+        return false;
+
+    // read access points
+
+    {
+        auto num_access_points = read_varint(sv);
+        uint64_t last_in_offset = 0, last_out_offset = 0;
+
+        for (uint64_t i = 0; i < num_access_points; i++) {
+            catalog_access_point ap;
+
+            ap.in_offset = last_in_offset + read_varint(sv);
+            ap.out_offset = last_out_offset + read_varint(sv);
+            ap.bits = (uint8_t)read_varint(sv);
+            ap.window = read_string(sv);
+
+            last_in_offset = ap.in_offset;
+            last_out_offset = ap.out_offset;
+
+            access_point_func(ap);
+        }
+    }
+
+    // read entries
+
+    string path;
+    vector<string_view> owners;
+    optional<time_t> last_mtime;
+    int64_t last_header_offset = 0;
+
+    auto read_owner = [&]() {
+        auto idx = read_varint(sv);
+
+        if (idx == owners.size())
+            owners.emplace_back(read_string(sv));
+        else if (idx > owners.size())
+            throw runtime_error("Invalid owner index in catalog.");
+
+        return owners[idx];
+    };
+
+    while (!sv.empty()) {
+        catalog_entry ent;
+
+        auto flags = read_varint(sv);
+        auto prefix = read_varint(sv);
+
+        if (prefix > path.length())
+            throw runtime_error("Invalid path prefix in catalog.");
+
+        path.resize(prefix);
+        path.append(read_string(sv));
+
+        ent.path = path;
+        ent.dir = flags & ENTRY_DIR;
+        ent.size = read_svarint(sv);
+
+        if (flags & ENTRY_HAS_MTIME) {
+            ent.mtime = last_mtime.value_or(0) + read_svarint(sv);
+            last_mtime = ent.mtime;
+        }
+
+        ent.mode = (uint32_t)read_varint(sv);
+        ent.user = read_owner();
+        ent.group = read_owner();
+
+        ent.header_offset = last_header_offset + read_svarint(sv);
+        last_header_offset = ent.header_offset;
+
+        auto data_offset = read_varint(sv);
+        ent.data_offset = data_offset == 0 ? -1 : (ent.header_offset + (int64_t)data_offset - 1);
+
+        func(ent);
+    }
+
+    return true;
+}
+
+string catalog_filename(const catalog_key& key) {
+    uint64_t hash = 0xcbf29ce484222325;
+    char s[17];
+
+    // FNV-1a
+
+    for (auto c : key.path) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+
+    for (unsigned int i = 0; i < 16; i++) {
+        s[15 - i] = "0123456789abcdef"[hash & 0xf];
+        hash >>= 4;
+    }
+
+    s[16] = 0;
+
+    return string(s) + ".cat";
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of tarfldr.
+ *
+ * tarfldr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * tarfldr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with tarfldr.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <filesystem>
+#include <stdint.h>
+#include <time.h>
+
+// The catalog is a cached copy of the entry list of an archive, so that we don't
+// have to decompress the whole thing every time it's opened. This file has no
+// Windows dependencies, so it can be built and benchmarked on other platforms.
+
+#define CATALOG_VERSION 3
+
+struct catalog_key {
+    std::string path; // UTF-8
+    uint64_t size;
+    int64_t mtime;
+    uint32_t type;
+};
+
+struct catalog_entry {
+    std::string_view path, user, group;
+    int64_t size;
+    std::optional<time_t> mtime;
+    bool dir;
+    uint32_t mode;
+    int64_t header_offset;
+    int64_t data_offset;
+};
+
+struct catalog_access_point {
+    uint64_t in_offset;
+    uint64_t out_offset;
+    uint8_t bits;
+    std::string_view window;
+};
+
+class catalog_writer {
+public:
+    catalog_writer(const catalog_key& key);
+
+    void add(const catalog_entry& ent);
+    void add_access_point(const catalog_access_point& ap);
+    void save(const std::filesystem::path& fn);
+
+private:
+    void add_owner(const std::string_view& s);
+
+    std::string buf;
+    std::string access_points;
+    uint64_t num_access_points = 0;
+    uint64_t last_in_offset = 0, last_out_offset = 0;
+    std::string entries;
+    std::string last_path;
+    std::optional<time_t> last_mtime;
+    int64_t last_header_offset = 0;
+    std::vector<std::string> owners;
+};
+
+bool load_catalog(const std::filesystem::path& fn, const catalog_key& key,
+                  const std::function<void(const catalog_entry&)>& func,
+                  const std::function<void(const catalog_access_point&)>& access_point_func);
+std::string catalog_filename(const catalog_key& key);
+void prune_catalogs(const std::filesystem::path& dir, const std::filesystem::path& keep, uint64_t max_size);
@@ -0,0 +1,1469 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of tarfldr.
+ *
+ * tarfldr is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * tarfldr is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with tarfldr.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "tarfldr.h"
+#include <errno.h>
+
+using namespace std;
+
+#define GZIP_BUFFER_SIZE 65536
+#define WINDOW_SIZE 32768
+#define GZIP_TRAILER_SIZE 8
+#define SKIP_BUFFER_SIZE 65536
+#define ARCHIVE_BUFFER_SIZE 65536
+
+#define BZ2_BLOCK_MAGIC 0x314159265359ull
+#define BZ2_EOS_MAGIC 0x177245385090ull
+#define BZ2_MAGIC_BITS 48
+#define BZ2_CRC_BITS 32
+#define BZ2_MAX_BLOCK_SIZE 0x200000 // compressed, in bytes - actually a bit over 900 KB
+#define BZ2_BUFFER_SIZE 65536
+#define BZ2_FIND_AHEAD 4 // blocks to look for beyond those being decompressed
+
+#define XZ_BUFFER_SIZE 65536
+#define DEFAULT_XZ_MEMORY_LIMIT 1024 // MB
+
+DWORD read_at(HANDLE h, uint64_t off, void* buf, DWORD len) {
+    OVERLAPPED ol;
+    DWORD read;
+
+    memset(&ol, 0, sizeof(ol));
+    ol.Offset = (DWORD)off;
+    ol.OffsetHigh = (DWORD)(off >> 32);
+
+    if (!ReadFile(h, buf, len, &read, &ol)) {
+        auto err = GetLastError();
+
+        if (err == ERROR_HANDLE_EOF)
+            return 0;
+
+        throw last_error("ReadFile", err);
+    }
+
+    return read;
+}
+
+static HANDLE open_archive_file(const filesystem::path& fn) {
+    auto h = CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (h == INVALID_HANDLE_VALUE)
+        throw last_error("CreateFile", GetLastError());
+
+    return h;
+}
+
+static la_ssize_t decoder_read_cb(struct archive* a, void* client_data, const void** buffer) {
+    auto& dec = *(decoder*)client_data;
+
+    try {
+        dec.check_cancelled();
+
+        auto read = dec.read((uint8_t*)dec.archive_buf.data(), dec.archive_buf.size());
+
+        *buffer = dec.archive_buf.data();
+
+        return (la_ssize_t)read;
+    } catch (const exception& e) {
+        archive_set_error(a, EIO, "%s", e.what());
+        return -1;
+    }
+}
+
+// Skipping means libarchive doesn't have to read the data of files it's not
+// interested in - for uncompressed files, this is just a case of changing our
+// position.
+
+static la_int64_t decoder_skip_cb(struct archive*, void* client_data, la_int64_t request) {
+    auto& dec = *(decoder*)client_data;
+
+    try {
+        dec.seek(dec.position + request);
+
+        return request;
+    } catch (...) {
+        return 0; // libarchive will fall back to reading
+    }
+}
+
+static la_int64_t decoder_seek_cb(struct archive* a, void* client_data, la_int64_t offset, int whence) {
+    auto& dec = *(decoder*)client_data;
+
+    try {
+        switch (whence) {
+            case SEEK_SET:
+                dec.seek(offset);
+                break;
+
+            case SEEK_CUR:
+                dec.seek(dec.position + offset);
+                break;
+
+            case SEEK_END:
+                dec.seek(dec.size().value() + offset);
+                break;
+
+            default:
+                return ARCHIVE_FATAL;
+        }
+
+        return (la_int64_t)dec.position;
+    } catch (const exception& e) {
+        archive_set_error(a, EIO, "%s", e.what());
+        return ARCHIVE_FATAL;
+    }
+}
+
+void decoder::open_archive(struct archive* a) {
+    archive_buf.resize(ARCHIVE_BUFFER_SIZE);
+
+    archive_read_set_callback_data(a, this);
+    archive_read_set_read_callback(a, decoder_read_cb);
+    archive_read_set_skip_callback(a, decoder_skip_cb);
+
+    // formats such as zip need to be able to seek relative to the end
+
+    if (size().has_value())
+        archive_read_set_seek_callback(a, decoder_seek_cb);
+
+    auto r = archive_read_open1(a);
+
+    if (r != ARCHIVE_OK)
+        throw runtime_error(archive_error_string(a));
+}
+
+// Returns a decoder for the uncompressed contents of a tarball. For anything
+// other than tar.gz, tar.bz2 and tar.xz, this is the file itself - the caller
+// should get libarchive to look out for compression in that case.
+
+unique_ptr<decoder> open_decoder(const filesystem::path& fn, archive_type type, vector<access_point>& index,
+                                 uint64_t spacing, bool index_complete, const atomic<bool>* cancelled) {
+    unique_ptr<decoder> dec;
+
+    if (type == (archive_type::tarball | archive_type::gzip))
+        dec = make_unique<gzip_decoder>(fn, index, spacing);
+    else if (type == (archive_type::tarball | archive_type::bz2))
+        return make_unique<bz2_decoder>(fn, index, index_complete, cancelled);
+    else if (type == (archive_type::tarball | archive_type::xz))
+        dec = make_unique<xz_decoder>(fn);
+    else
+        dec = make_unique<raw_decoder>(fn);
+
+    dec->cancelled = cancelled;
+
+    return dec;
+}
+
+// Works out the compression from the first few bytes of the file, in case the
+// extension is wrong - people do call gzipped tarballs foo.tar, or bzip2 ones
+// foo.tar.gz. If we don't recognize it, we go with what the name says, and for
+// tarballs libarchive gets to have a go.
+
+archive_type detect_compression(const filesystem::path& fn, archive_type type) {
+    static const uint8_t gzip_magic[] = { 0x1f, 0x8b, 8 }; // deflate
+    static const uint8_t bz2_magic[] = { 'B', 'Z', 'h' }; // then the block size, 1 to 9
+    static const uint8_t xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+    uint8_t buf[6];
+    DWORD read;
+
+    try {
+        unique_handle h{open_archive_file(fn)};
+
+        read = read_at(h.get(), 0, buf, sizeof(buf));
+    } catch (...) {
+        return type;
+    }
+
+    auto matches = [&](const uint8_t* magic, size_t len) {
+        return read >= len && !memcmp(buf, magic, len);
+    };
+
+    archive_type comp;
+
+    if (matches(gzip_magic, sizeof(gzip_magic)))
+        comp = archive_type::gzip;
+    else if (matches(bz2_magic, sizeof(bz2_magic)) && read > sizeof(bz2_magic) && buf[3] >= '1' && buf[3] <= '9')
+        comp = archive_type::bz2;
+    else if (matches(xz_magic, sizeof(xz_magic)))
+        comp = archive_type::xz;
+    else if (type & archive_type::tarball)
+        return archive_type::tarball;
+    else
+        return type;
+
+    // a single compressed file stays that, even if it's in fact a tarball
+    return (type & archive_type::tarball) ? (archive_type::tarball | comp) : comp;
+}
+
+unsigned int xz_threads() {
+    auto threads = get_setting(u"XzThreads", 0);
+
+    return threads != 0 ? threads : max(thread::hardware_concurrency(), 1u);
+}
+
+uint64_t xz_memory_limit() {
+    return (uint64_t)get_setting(u"XzMemoryLimit", DEFAULT_XZ_MEMORY_LIMIT) << 20;
+}
+
+void decoder::check_cancelled() const {
+    if (cancelled && *cancelled)
+        throw runtime_error("Cancelled.");
+
+    if (outer)
+        outer->check_cancelled();
+}
+
+void decoder::skip_to(uint64_t off) {
+    string scratch;
+
+    scratch.resize((size_t)min(off - position, (uint64_t)SKIP_BUFFER_SIZE));
+
+    while (position < off) {
+        check_cancelled();
+
+        if (read((uint8_t*)scratch.data(), (size_t)min(off - position, (uint64_t)scratch.size())) == 0)
+            throw runtime_error("Tried to seek beyond end of file.");
+    }
+}
+
+raw_decoder::raw_decoder(const filesystem::path& fn) : h(open_archive_file(fn)) {
+    LARGE_INTEGER li;
+
+    if (!GetFileSizeEx(h.get(), &li))
+        throw last_error("GetFileSizeEx", GetLastError());
+
+    file_size = li.QuadPart;
+}
+
+size_t raw_decoder::read(uint8_t* buf, size_t len) {
+    auto read = read_at(h.get(), position, buf, (DWORD)min(len, (size_t)0x40000000));
+
+    position += read;
+
+    return read;
+}
+
+void raw_decoder::seek(uint64_t off) {
+    position = off;
+}
+
+optional<uint64_t> raw_decoder::size() const {
+    return file_size;
+}
+
+gzip_decoder::gzip_decoder(const filesystem::path& fn, vector<access_point>& index, uint64_t spacing) :
+                           h(open_archive_file(fn)), index(index), spacing(spacing) {
+    memset(&strm, 0, sizeof(strm));
+
+    auto ret = inflateInit2(&strm, 16 + MAX_WBITS); // gzip header
+
+    if (ret != Z_OK)
+        throw formatted_error("inflateInit2 returned {}.", ret);
+
+    inbuf.resize(GZIP_BUFFER_SIZE);
+}
+
+gzip_decoder::~gzip_decoder() {
+    inflateEnd(&strm);
+}
+
+void gzip_decoder::refill() {
+    auto read = read_at(h.get(), in_offset, inbuf.data(), (DWORD)inbuf.size());
+
+    strm.next_in = (Bytef*)inbuf.data();
+    strm.avail_in = read;
+    in_offset += read;
+
+    if (read == 0)
+        in_eof = true;
+}
+
+void gzip_decoder::add_access_point() {
+    access_point ap;
+    string window;
+    uInt window_len = WINDOW_SIZE;
+
+    if (spacing == 0 || position < (index.empty() ? spacing : (index.back().out_offset + spacing)))
+        return;
+
+    ap.in_offset = in_offset - strm.avail_in;
+    ap.bits = strm.data_type & 7;
+    ap.out_offset = position;
+
+    window.resize(WINDOW_SIZE);
+
+    auto ret = inflateGetDictionary(&strm, (Bytef*)window.data(), &window_len);
+    if (ret != Z_OK)
+        throw formatted_error("inflateGetDictionary returned {}.", ret);
+
+    if (window_len > 0) {
+        uLongf len = compressBound(window_len);
+
+        ap.window.resize(len);
+
+        ret = compress2((Bytef*)ap.window.data(), &len, (Bytef*)window.data(), window_len, Z_BEST_SPEED);
+        if (ret != Z_OK)
+            throw formatted_error("compress2 returned {}.", ret);
+
+        ap.window.resize(len);
+    }
+
+    if (index_mutex) {
+        lock_guard lg(*index_mutex);
+
+        index.emplace_back(move(ap));
+    } else
+        index.emplace_back(move(ap));
+}
+
+size_t gzip_decoder::read(uint8_t* buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len && !finished) {
+        if (strm.avail_in == 0) {
+            refill();
+
+            if (in_eof) {
+                if (member_start)
+                    finished = true;
+                else
+                    throw runtime_error("Unexpected end of gzip file.");
+
+                break;
+            }
+        }
+
+        if (trailer_left > 0) {
+            auto skip = min(trailer_left, strm.avail_in);
+
+            strm.next_in += skip;
+            strm.avail_in -= skip;
+            trailer_left -= skip;
+
+            continue;
+        }
+
+        strm.next_out = buf + done;
+        strm.avail_out = (uInt)min(len - done, (size_t)0x40000000);
+
+        // Z_BLOCK makes inflate stop at the end of each deflate block, which is
+        // where we can put access points.
+
+        auto ret = inflate(&strm, Z_BLOCK);
+        auto produced = (size_t)(strm.next_out - (buf + done));
+
+        done += produced;
+        position += produced;
+
+        if (ret == Z_STREAM_END) {
+            // Files can consist of several gzip members, one after the other.
+            // If we started in the middle of one, we have to skip its trailer
+            // ourselves.
+
+            if (raw) {
+                trailer_left = GZIP_TRAILER_SIZE;
+                raw = false;
+            }
+
+            inflateReset2(&strm, 16 + MAX_WBITS);
+            member_start = true;
+
+            continue;
+        }
+
+        if (ret == Z_DATA_ERROR && member_start && position > 0) { // trailing garbage, which gzip ignores
+            finished = true;
+            break;
+        }
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            throw formatted_error("inflate returned {}.", ret);
+
+        if (produced > 0)
+            member_start = false;
+
+        if ((strm.data_type & 128) && !(strm.data_type & 64)) {
+            member_start = false;
+            add_access_point();
+        }
+    }
+
+    return done;
+}
+
+void gzip_decoder::restart(const access_point* ap) {
+    strm.next_in = nullptr;
+    strm.avail_in = 0;
+    in_eof = false;
+    trailer_left = 0;
+    finished = false;
+
+    if (!ap) {
+        inflateReset2(&strm, 16 + MAX_WBITS);
+        in_offset = 0;
+        raw = false;
+        member_start = true;
+        position = 0;
+
+        return;
+    }
+
+    // start raw inflate in the middle of the stream, in the manner of zlib's zran.c
+
+    inflateReset2(&strm, -MAX_WBITS);
+    in_offset = ap->in_offset - (ap->bits ? 1 : 0);
+
+    if (ap->bits) {
+        refill();
+
+        if (strm.avail_in == 0)
+            throw runtime_error("Unexpected end of gzip file.");
+
+        auto c = *strm.next_in;
+
+        strm.next_in++;
+        strm.avail_in--;
+
+        inflatePrime(&strm, ap->bits, c >> (8 - ap->bits));
+    }
+
+    if (!ap->window.empty()) {
+        string window;
+        uLongf window_len = WINDOW_SIZE;
+
+        window.resize(WINDOW_SIZE);
+
+        auto ret = uncompress((Bytef*)window.data(), &window_len, (Bytef*)ap->window.data(), (uLong)ap->window.size());
+        if (ret != Z_OK)
+            throw formatted_error("uncompress returned {}.", ret);
+
+        ret = inflateSetDictionary(&strm, (Bytef*)window.data(), (uInt)window_len);
+        if (ret != Z_OK)
+            throw formatted_error("inflateSetDictionary returned {}.", ret);
+    }
+
+    raw = true;
+    member_start = false;
+    position = ap->out_offset;
+}
+
+void gzip_decoder::seek(uint64_t off) {
+    if (off == position)
+        return;
+
+    // find the last access point at or before off
+
+    auto it = upper_bound(index.begin(), index.end(), off, [](uint64_t off, const access_point& ap) {
+        return off < ap.out_offset;
+    });
+
+    auto ap = it == index.begin() ? nullptr : &*prev(it);
+
+    if (off < position || (ap && ap->out_offset > position))
+        restart(ap);
+
+    // decompress from there
+
+    skip_to(off);
+}
+
+// Blocks in a bzip2 file aren't byte-aligned, so we have to look for the magic
+// numbers at every bit offset.
+
+static optional<bz2_magic> find_bz2_magic(const decoder& dec, HANDLE h, uint64_t bit) {
+    string buf;
+    uint64_t off = bit / 8, w = 0;
+
+    buf.resize(BZ2_BUFFER_SIZE);
+
+    do {
+        dec.check_cancelled();
+
+        auto read = read_at(h, off, buf.data(), (DWORD)buf.size());
+
+        if (read == 0)
+            return nullopt;
+
+        for (DWORD i = 0; i < read; i++) {
+            w = (w << 8) | (uint8_t)buf[i];
+
+            // check every window of 48 bits ending within this byte, earliest first
+
+            for (int shift = 7; shift >= 0; shift--) {
+                auto end = ((off + i + 1) * 8) - shift;
+
+                if (end < bit + BZ2_MAGIC_BITS)
+                    continue;
+
+                auto v = (w >> shift) & ((1ull << BZ2_MAGIC_BITS) - 1);
+
+                if (v == BZ2_BLOCK_MAGIC || v == BZ2_EOS_MAGIC)
+                    return bz2_magic{end - BZ2_MAGIC_BITS, v == BZ2_EOS_MAGIC};
+            }
+        }
+
+        off += read;
+    } while (true);
+}
+
+class bit_writer {
+public:
+    bit_writer(string& s) : s(s) { }
+
+    void put(uint32_t v, unsigned int bits) { // up to 24 bits at a time
+        acc = (acc << bits) | (v & ((1u << bits) - 1));
+        num = (uint8_t)(num + bits);
+
+        while (num >= 8) {
+            s.push_back((char)(acc >> (num - 8)));
+            num -= 8;
+        }
+    }
+
+    void flush() {
+        if (num > 0)
+            put(0, 8 - num);
+    }
+
+private:
+    string& s;
+    uint32_t acc = 0;
+    uint8_t num = 0;
+};
+
+// Decompress a single block, by making it into a bzip2 stream of its own. Returns
+// nullopt if the data is invalid, which probably means that what we took to be
+// the end of the block was a magic number occurring by chance.
+
+static optional<string> decode_bz2_block(HANDLE h, uint64_t start, uint64_t end) {
+    string in, stream, out;
+    bz_stream strm;
+    uint32_t crc = 0;
+    auto first = start / 8;
+
+    in.resize((size_t)(((end + 7) / 8) - first));
+
+    if (read_at(h, first, in.data(), (DWORD)in.size()) != in.size())
+        throw runtime_error("Unexpected end of bzip2 file.");
+
+    auto get_bit = [&](uint64_t bit) {
+        bit -= first * 8;
+
+        return ((uint8_t)in[(size_t)(bit / 8)] >> (7 - (bit % 8))) & 1;
+    };
+
+    for (uint64_t b = start + BZ2_MAGIC_BITS; b < start + BZ2_MAGIC_BITS + BZ2_CRC_BITS; b++) {
+        crc = (crc << 1) | get_bit(b);
+    }
+
+    {
+        bit_writer bw(stream);
+        auto shift = (unsigned int)(start % 8);
+        auto bits = end - start;
+
+        stream = "BZh9";
+
+        for (size_t i = 0; i < bits / 8; i++) {
+            auto c = (uint8_t)((uint8_t)in[i] << shift);
+
+            if (shift != 0)
+                c |= (uint8_t)in[i + 1] >> (8 - shift);
+
+            bw.put(c, 8);
+        }
+
+        for (auto b = start + ((bits / 8) * 8); b < end; b++) {
+            bw.put(get_bit(b), 1);
+        }
+
+        // with only one block, the stream CRC is the same as the block CRC
+
+        bw.put((uint32_t)(BZ2_EOS_MAGIC >> 24), 24);
+        bw.put((uint32_t)BZ2_EOS_MAGIC, 24);
+        bw.put(crc >> 16, 16);
+        bw.put(crc, 16);
+        bw.flush();
+    }
+
+    memset(&strm, 0, sizeof(strm));
+
+    auto ret = BZ2_bzDecompressInit(&strm, 0, 0);
+    if (ret != BZ_OK)
+        throw formatted_error("BZ2_bzDecompressInit returned {}.", ret);
+
+    strm.next_in = stream.data();
+    strm.avail_in = (unsigned int)stream.size();
+
+    do {
+        if (out.size() == strm.total_out_lo32) {
+            out.resize(max(out.size() * 2, (size_t)BZ2_MAX_BLOCK_SIZE));
+            strm.next_out = out.data() + strm.total_out_lo32;
+            strm.avail_out = (unsigned int)(out.size() - strm.total_out_lo32);
+        }
+
+        ret = BZ2_bzDecompress(&strm);
+
+        if (ret == BZ_OK && strm.avail_in == 0 && strm.avail_out != 0)
+            ret = BZ_DATA_ERROR; // truncated
+    } while (ret == BZ_OK);
+
+    BZ2_bzDecompressEnd(&strm);
+
+    if (ret == BZ_DATA_ERROR || ret == BZ_DATA_ERROR_MAGIC)
+        return nullopt;
+    else if (ret != BZ_STREAM_END)
+        throw formatted_error("BZ2_bzDecompress returned {}.", ret);
+
+    out.resize(strm.total_out_lo32);
+
+    return out;
+}
+
+static bz2_block_data decode_bz2_block(const decoder& dec, HANDLE h, const bz2_block& b) {
+    auto end = b.end;
+
+    if (end == 0) {
+        auto m = find_bz2_magic(dec, h, b.start + BZ2_MAGIC_BITS);
+
+        if (!m.has_value())
+            throw runtime_error("Unexpected end of bzip2 file.");
+
+        end = m.value().bit;
+    }
+
+    return { decode_bz2_block(h, b.start, end), end };
+}
+
+// If the index is only partial, because the scan didn't finish, we carry on
+// looking for blocks after the last one it knows about.
+
+bz2_decoder::bz2_decoder(const filesystem::path& fn, vector<access_point>& index, bool index_complete,
+                         const atomic<bool>* cancelled) : h(open_archive_file(fn)), index(index) {
+    this->cancelled = cancelled;
+    threads = max(thread::hardware_concurrency(), 1u);
+
+    if (!index.empty()) {
+        for (const auto& ap : index) {
+            blocks.push_back({ (ap.in_offset * 8) - ap.bits, 0, ap.out_offset });
+        }
+
+        known_offsets = blocks.size();
+
+        if (!index_complete)
+            next_magic = find_bz2_magic(*this, h.get(), blocks.back().start + BZ2_MAGIC_BITS);
+
+        return;
+    }
+
+    // We find blocks as we go, a few ahead of the ones being decompressed -
+    // searching the whole file first would take a while for a big one. We
+    // don't bother checking the stream headers, as we'll find out soon enough
+    // if this isn't really a bzip2 file.
+
+    next_magic = find_bz2_magic(*this, h.get(), 0);
+}
+
+// Looks for more blocks, until we know about num of them or we reach the end.
+
+void bz2_decoder::find_blocks(size_t num) {
+    while (blocks.size() < num && next_magic.has_value()) {
+        auto m = next_magic.value();
+
+        next_magic = find_bz2_magic(*this, h.get(), m.bit + BZ2_MAGIC_BITS);
+
+        if (!m.eos)
+            blocks.push_back({ m.bit, next_magic.has_value() ? next_magic.value().bit : 0, UINT64_MAX });
+    }
+}
+
+bool bz2_decoder::next_block() {
+    // Keep blocks decompressing in the background, up to one per CPU. We ramp
+    // this up gradually, so reading a small file doesn't decompress lots of
+    // blocks that we don't need.
+
+    find_blocks(block_num + readahead + BZ2_FIND_AHEAD);
+
+    while (pending.size() < readahead && queued < blocks.size()) {
+        pending.emplace_back(async(launch::async, [this, h = h.get(), b = blocks[queued]]() {
+            return decode_bz2_block(*this, h, b);
+        }));
+
+        queued++;
+    }
+
+    if (pending.empty())
+        return false;
+
+    auto bd = pending.front().get();
+    auto& b = blocks[block_num];
+
+    pending.pop_front();
+
+    if (!bd.data.has_value()) {
+        // Assume that what we thought was the end of the block was a false
+        // positive, and try the next magic number along.
+
+        auto m = find_bz2_magic(*this, h.get(), bd.end + BZ2_MAGIC_BITS);
+
+        while (true) {
+            if (!m.has_value() || m.value().bit - b.start > (uint64_t)BZ2_MAX_BLOCK_SIZE * 8)
+                throw formatted_error("Error decompressing bzip2 block at bit offset {}.", b.start);
+
+            bd = { decode_bz2_block(h.get(), b.start, m.value().bit), m.value().bit };
+
+            if (bd.data.has_value())
+                break;
+
+            m = find_bz2_magic(*this, h.get(), m.value().bit + BZ2_MAGIC_BITS);
+        }
+
+        // forget any blocks which turned out to be part of this one
+
+        pending.clear();
+
+        while (block_num + 1 < blocks.size() && blocks[block_num + 1].start < bd.end) {
+            blocks.erase(blocks.begin() + block_num + 1);
+        }
+
+        if (next_magic.has_value() && next_magic.value().bit < bd.end)
+            next_magic = find_bz2_magic(*this, h.get(), bd.end);
+
+        queued = block_num + 1;
+    }
+
+    b.end = bd.end;
+    b.out_offset = position;
+
+    if (block_num == known_offsets)
+        known_offsets++;
+
+    // only the scanner gets to add to the index, as it's shared
+
+    if (index_mutex && block_num == index.size()) {
+        auto in_offset = (b.start + 7) / 8;
+        lock_guard lg(*index_mutex);
+
+        index.emplace_back(access_point{ in_offset, position, (uint8_t)((in_offset * 8) - b.start), "" });
+    }
+
+    block = move(bd.data.value());
+    block_off = 0;
+    block_num++;
+
+    if (readahead < threads)
+        readahead++;
+
+    return true;
+}
+
+size_t bz2_decoder::read(uint8_t* buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        if (block_off == block.size()) {
+            if (!next_block())
+                break;
+
+            continue;
+        }
+
+        auto copy_size = min(len - done, block.size() - block_off);
+
+        memcpy(buf + done, block.data() + block_off, copy_size);
+
+        block_off += copy_size;
+        done += copy_size;
+        position += copy_size;
+    }
+
+    return done;
+}
+
+void bz2_decoder::seek(uint64_t off) {
+    if (off == position)
+        return;
+
+    // find the block containing off, out of those we know the offsets of
+
+    auto it = upper_bound(blocks.begin(), blocks.begin() + known_offsets, off, [](uint64_t off, const bz2_block& b) {
+        return off < b.out_offset;
+    });
+
+    if (it != blocks.begin()) {
+        auto num = (size_t)(prev(it) - blocks.begin());
+        auto block_start = blocks[num].out_offset;
+
+        if (num + 1 == block_num && block_start + block.size() > off) { // within current block
+            block_off = (size_t)(off - block_start);
+            position = off;
+            return;
+        }
+
+        if (off < position || num >= block_num) {
+            pending.clear();
+            block.clear();
+            block_off = 0;
+            block_num = queued = num;
+            position = block_start;
+            readahead = 1;
+        }
+    } else if (off < position)
+        throw runtime_error("Unable to seek backwards in bzip2 file.");
+
+    skip_to(off);
+}
+
+xz_decoder::xz_decoder(const filesystem::path& fn) : h(open_archive_file(fn)) {
+    inbuf.resize(XZ_BUFFER_SIZE);
+
+    read_index();
+
+    lzma_index_iter_init(&iter, idx);
+
+    // If the file was compressed with several threads, it'll have been split
+    // into blocks, which we can decompress at the same time. Each block in
+    // flight holds all of its output, so stay within the memory limit.
+
+    auto threads = xz_threads();
+
+    if (threads > 1 && lzma_index_block_count(idx) > 1) {
+        lzma_index_iter it;
+        uint64_t largest = 1;
+
+        lzma_index_iter_init(&it, idx);
+
+        while (!lzma_index_iter_next(&it, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+            blocks.push_back({ it.block.compressed_file_offset, it.block.unpadded_size, it.block.total_size,
+                               it.block.uncompressed_file_offset, it.block.uncompressed_size, it.stream.flags->check });
+
+            largest = max(largest, (uint64_t)it.block.uncompressed_size);
+        }
+
+        max_readahead = (unsigned int)min((uint64_t)threads, xz_memory_limit() / largest);
+
+        if (max_readahead < 2)
+            blocks.clear();
+    }
+}
+
+xz_decoder::~xz_decoder() {
+    lzma_end(&strm);
+
+    if (idx)
+        lzma_index_end(idx, nullptr);
+}
+
+// Read the indices of all the streams in the file, working backwards from the
+// end, in the same way as xz --list does.
+
+void xz_decoder::read_index() {
+    LARGE_INTEGER li;
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags header_flags, footer_flags;
+    uint64_t stream_padding = 0;
+    string index_buf;
+
+    if (!GetFileSizeEx(h.get(), &li))
+        throw last_error("GetFileSizeEx", GetLastError());
+
+    auto pos = (uint64_t)li.QuadPart;
+
+    auto read_exact = [&](uint64_t off, void* data, size_t len) {
+        if (read_at(h.get(), off, data, (DWORD)len) != len)
+            throw runtime_error("Unexpected end of xz file.");
+    };
+
+    while (pos > 0) {
+        lzma_index* this_idx = nullptr;
+        uint64_t memlimit = UINT64_MAX;
+        size_t in_pos = 0;
+
+        if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+            throw runtime_error("xz file truncated.");
+
+        // skip stream padding, which is a multiple of four zero bytes
+
+        read_exact(pos - sizeof(uint32_t), buf, sizeof(uint32_t));
+
+        if (*(uint32_t*)buf == 0) {
+            pos -= sizeof(uint32_t);
+            stream_padding += sizeof(uint32_t);
+            continue;
+        }
+
+        pos -= LZMA_STREAM_HEADER_SIZE;
+        read_exact(pos, buf, LZMA_STREAM_HEADER_SIZE);
+
+        auto ret = lzma_stream_footer_decode(&footer_flags, buf);
+        if (ret != LZMA_OK)
+            throw formatted_error("lzma_stream_footer_decode returned {}.", ret);
+
+        if (footer_flags.backward_size > pos)
+            throw runtime_error("xz index extends beyond start of file.");
+
+        pos -= footer_flags.backward_size;
+        index_buf.resize((size_t)footer_flags.backward_size);
+        read_exact(pos, index_buf.data(), index_buf.size());
+
+        ret = lzma_index_buffer_decode(&this_idx, &memlimit, nullptr, (uint8_t*)index_buf.data(), &in_pos, index_buf.size());
+        if (ret != LZMA_OK)
+            throw formatted_error("lzma_index_buffer_decode returned {}.", ret);
+
+        try {
+            auto blocks_size = lzma_index_total_size(this_idx);
+
+            if (blocks_size + LZMA_STREAM_HEADER_SIZE > pos)
+                throw runtime_error("xz stream extends beyond start of file.");
+
+            pos -= blocks_size + LZMA_STREAM_HEADER_SIZE;
+            read_exact(pos, buf, LZMA_STREAM_HEADER_SIZE);
+
+            ret = lzma_stream_header_decode(&header_flags, buf);
+            if (ret != LZMA_OK)
+                throw formatted_error("lzma_stream_header_decode returned {}.", ret);
+
+            ret = lzma_stream_flags_compare(&header_flags, &footer_flags);
+            if (ret != LZMA_OK)
+                throw runtime_error("xz stream header and footer do not match.");
+
+            lzma_index_stream_flags(this_idx, &footer_flags);
+            lzma_index_stream_padding(this_idx, stream_padding);
+
+            if (idx) {
+                ret = lzma_index_cat(this_idx, idx, nullptr);
+                if (ret != LZMA_OK)
+                    throw formatted_error("lzma_index_cat returned {}.", ret);
+
+                idx = nullptr;
+            }
+        } catch (...) {
+            lzma_index_end(this_idx, nullptr);
+            throw;
+        }
+
+        idx = this_idx;
+        stream_padding = 0;
+    }
+
+    if (!idx)
+        throw runtime_error("Empty xz file.");
+}
+
+optional<uint64_t> xz_decoder::size() const {
+    return lzma_index_uncompressed_size(idx);
+}
+
+// Decodes the header of the block at off. The caller has to free the filter
+// options afterwards.
+
+static void read_xz_block_header(HANDLE h, uint64_t off, lzma_check check, lzma_vli unpadded_size,
+                                 lzma_block& block, lzma_filter* filters) {
+    uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+
+    if (read_at(h, off, header, 1) != 1)
+        throw runtime_error("Unexpected end of xz file.");
+
+    memset(&block, 0, sizeof(block));
+    block.version = 1;
+    block.check = check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(header[0]);
+
+    if (read_at(h, off + 1, header + 1, block.header_size - 1) != block.header_size - 1)
+        throw runtime_error("Unexpected end of xz file.");
+
+    filters[0].id = LZMA_VLI_UNKNOWN;
+
+    auto ret = lzma_block_header_decode(&block, nullptr, header);
+    if (ret != LZMA_OK)
+        throw formatted_error("lzma_block_header_decode returned {}.", ret);
+
+    ret = lzma_block_compressed_size(&block, unpadded_size);
+    if (ret != LZMA_OK) {
+        for (unsigned int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+            free(filters[i].options);
+        }
+
+        throw formatted_error("lzma_block_compressed_size returned {}.", ret);
+    }
+}
+
+void xz_decoder::start_block() {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    auto off = iter.block.compressed_file_offset;
+
+    read_xz_block_header(h.get(), off, iter.stream.flags->check, iter.block.unpadded_size, block_info, filters);
+
+    auto ret = lzma_block_decoder(&strm, &block_info);
+
+    for (unsigned int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+        free(filters[i].options);
+    }
+
+    block_info.filters = nullptr; // only needed when initializing the decoder
+
+    if (ret != LZMA_OK)
+        throw formatted_error("lzma_block_decoder returned {}.", ret);
+
+    in_offset = off + block_info.header_size;
+    strm.next_in = nullptr;
+    strm.avail_in = 0;
+    position = iter.block.uncompressed_file_offset;
+    in_block = true;
+}
+
+static string decode_xz_block(HANDLE h, const xz_block& b) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    string in, out;
+    size_t in_pos = 0, out_pos = 0;
+
+    read_xz_block_header(h, b.compressed_offset, b.check, b.unpadded_size, block, filters);
+
+    // the rest of the block: compressed data, padding, and check
+
+    in.resize((size_t)(b.total_size - block.header_size));
+    out.resize((size_t)b.uncompressed_size);
+
+    auto ret = LZMA_OK;
+
+    if (read_at(h, b.compressed_offset + block.header_size, in.data(), (DWORD)in.size()) != in.size())
+        ret = LZMA_DATA_ERROR;
+    else {
+        ret = lzma_block_buffer_decode(&block, nullptr, (uint8_t*)in.data(), &in_pos, in.size(),
+                                       (uint8_t*)out.data(), &out_pos, out.size());
+    }
+
+    for (unsigned int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+        free(filters[i].options);
+    }
+
+    if (ret != LZMA_OK || out_pos != out.size())
+        throw formatted_error("Error decompressing xz block at offset {} (lzma_block_buffer_decode returned {}).", b.compressed_offset, ret);
+
+    return out;
+}
+
+bool xz_decoder::next_block() {
+    // Like bz2_decoder, ramp up the number of blocks we're decompressing at
+    // once, so reading a small file doesn't waste lots of work.
+
+    while (pending.size() < readahead && queued < blocks.size()) {
+        pending.emplace_back(async(launch::async, [h = h.get(), b = blocks[queued]]() {
+            return decode_xz_block(h, b);
+        }));
+
+        queued++;
+    }
+
+    if (pending.empty())
+        return false;
+
+    block = pending.front().get();
+    pending.pop_front();
+
+    position = blocks[block_num].uncompressed_offset;
+    block_off = 0;
+    block_num++;
+
+    if (readahead < max_readahead)
+        readahead++;
+
+    return true;
+}
+
+size_t xz_decoder::read(uint8_t* buf, size_t len) {
+    size_t done = 0;
+
+    if (!blocks.empty()) {
+        while (done < len) {
+            if (block_off == block.size()) {
+                if (!next_block())
+                    break;
+
+                continue;
+            }
+
+            auto copy_size = min(len - done, block.size() - block_off);
+
+            memcpy(buf + done, block.data() + block_off, copy_size);
+
+            block_off += copy_size;
+            done += copy_size;
+            position += copy_size;
+        }
+
+        return done;
+    }
+
+    while (done < len && !finished) {
+        if (!in_block) {
+            if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+                finished = true;
+                break;
+            }
+
+            start_block();
+        }
+
+        if (strm.avail_in == 0) {
+            auto read = read_at(h.get(), in_offset, inbuf.data(), (DWORD)inbuf.size());
+
+            if (read == 0)
+                throw runtime_error("Unexpected end of xz file.");
+
+            strm.next_in = (uint8_t*)inbuf.data();
+            strm.avail_in = read;
+            in_offset += read;
+        }
+
+        strm.next_out = buf + done;
+        strm.avail_out = len - done;
+
+        auto ret = lzma_code(&strm, LZMA_RUN);
+        auto produced = (size_t)(strm.next_out - (buf + done));
+
+        done += produced;
+        position += produced;
+
+        if (ret == LZMA_STREAM_END)
+            in_block = false;
+        else if (ret != LZMA_OK)
+            throw formatted_error("lzma_code returned {}.", ret);
+    }
+
+    return done;
+}
+
+void xz_decoder::seek(uint64_t off) {
+    if (off == position)
+        return;
+
+    if (!blocks.empty()) {
+        if (off >= size()) {
+            if (off != size())
+                throw runtime_error("Tried to seek beyond end of file.");
+
+            pending.clear();
+            block.clear();
+            block_off = 0;
+            block_num = queued = blocks.size();
+            position = off;
+
+            return;
+        }
+
+        // find the block containing off
+
+        auto it = upper_bound(blocks.begin(), blocks.end(), off, [](uint64_t off, const xz_block& b) {
+            return off < b.uncompressed_offset;
+        });
+
+        auto num = (size_t)(prev(it) - blocks.begin());
+
+        if (num + 1 == block_num && off < blocks[num].uncompressed_offset + block.size()) { // within current block
+            block_off = (size_t)(off - blocks[num].uncompressed_offset);
+            position = off;
+            return;
+        }
+
+        // if it's in the next block, it's probably already being decompressed
+
+        if (off < position || num > block_num) {
+            pending.clear();
+            block.clear();
+            block_off = 0;
+            block_num = queued = num;
+            position = blocks[num].uncompressed_offset;
+            readahead = 1;
+        }
+
+        skip_to(off);
+        return;
+    }
+
+    // carry on decompressing if it's later in the current block
+
+    if (in_block && off > position && off < iter.block.uncompressed_file_offset + iter.block.uncompressed_size) {
+        skip_to(off);
+        return;
+    }
+
+    finished = false;
+
+    if (lzma_index_iter_locate(&iter, off)) { // past end
+        if (off != size())
+            throw runtime_error("Tried to seek beyond end of file.");
+
+        in_block = false;
+        finished = true;
+        position = off;
+
+        return;
+    }
+
+    start_block();
+    skip_to(off);
+}
+
+readahead_decoder::readahead_decoder(unique_ptr<decoder> inner, uint64_t end) : inner(move(inner)), end(end) {
+    position = this->inner->position;
+
+    // Take over whatever flag the inner decoder was given, so that it gets
+    // stopped either by that or by us.
+
+    cancelled = this->inner->cancelled;
+    this->inner->cancelled = &stopping;
+    this->inner->outer = this;
+
+    start();
+}
+
+readahead_decoder::~readahead_decoder() {
+    stop();
+}
+
+void readahead_decoder::start() {
+    producer = thread([&]() {
+        produce();
+    });
+}
+
+// Waits for the producer thread to finish, and throws away anything it's
+// decompressed that we haven't read yet.
+
+void readahead_decoder::stop() {
+    {
+        lock_guard lg(mutex);
+
+        stopping = true;
+    }
+
+    cv.notify_all();
+
+    if (producer.joinable())
+        producer.join();
+
+    while (!blocks.empty()) {
+        spare.emplace_back(move(blocks.front()));
+        blocks.pop_front();
+    }
+
+    current.clear();
+    current_off = 0;
+    eof = false;
+    error = nullptr;
+    direct = direct_state::none;
+    stopping = false;
+}
+
+void readahead_decoder::produce() {
+    try {
+        while (true) {
+            string block;
+
+            {
+                unique_lock ul(mutex);
+
+                cv.wait(ul, [&]() {
+                    return stopping || blocks.size() < READAHEAD_BLOCKS;
+                });
+
+                if (stopping)
+                    return;
+
+                check_cancelled();
+
+                // The reader is waiting for us and has given us somewhere big
+                // enough to decompress into, so we don't need to go through a
+                // block. This can't happen if there's anything queued, as
+                // that has to come first.
+
+                if (direct == direct_state::requested && blocks.empty()) {
+                    auto buf = direct_buf;
+                    auto len = inner->position >= end ? 0 : (size_t)min((uint64_t)direct_len, end - inner->position);
+
+                    direct = direct_state::taken;
+                    ul.unlock();
+
+                    auto read = len == 0 ? 0 : inner->read(buf, len);
+
+                    ul.lock();
+
+                    direct_read = read;
+                    direct = direct_state::done;
+
+                    if (read == 0)
+                        eof = true;
+
+                    ul.unlock();
+                    cv.notify_all();
+
+                    if (read == 0)
+                        return;
+
+                    continue;
+                }
+
+                if (!spare.empty()) {
+                    block = move(spare.back());
+                    spare.pop_back();
+                }
+            }
+
+            auto len = inner->position >= end ? 0 : (size_t)min((uint64_t)READAHEAD_BLOCK_SIZE, end - inner->position);
+
+            block.resize(len);
+
+            auto read = len == 0 ? 0 : inner->read((uint8_t*)block.data(), len);
+
+            block.resize(read);
+
+            {
+                lock_guard lg(mutex);
+
+                if (read == 0)
+                    eof = true;
+                else
+                    blocks.emplace_back(move(block));
+            }
+
+            cv.notify_all();
+
+            if (read == 0)
+                return;
+        }
+    } catch (...) {
+        {
+            lock_guard lg(mutex);
+
+            error = current_exception();
+
+            if (direct == direct_state::taken) {
+                direct_read = 0;
+                direct = direct_state::done;
+            }
+        }
+
+        cv.notify_all();
+    }
+}
+
+size_t readahead_decoder::read(uint8_t* buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        if (current_off == current.size()) {
+            unique_lock ul(mutex);
+
+            if (current.capacity() != 0) {
+                spare.emplace_back(move(current));
+                current.clear();
+                current_off = 0;
+            }
+
+            // If nothing's ready and the caller wants at least a block's worth,
+            // save a copy by asking for it to be decompressed into buf.
+
+            if (blocks.empty() && !eof && !error && len - done >= READAHEAD_BLOCK_SIZE) {
+                direct_buf = buf + done;
+                direct_len = len - done;
+                direct = direct_state::requested;
+
+                cv.notify_all();
+
+                cv.wait(ul, [&]() {
+                    return direct == direct_state::done ||
+                           (direct == direct_state::requested && (!blocks.empty() || eof || error));
+                });
+
+                if (direct == direct_state::done) {
+                    auto read = direct_read;
+
+                    direct = direct_state::none;
+                    done += read;
+                    position += read;
+
+                    if (read == 0) {
+                        if (error && done == 0)
+                            rethrow_exception(error);
+
+                        break;
+                    }
+
+                    continue;
+                }
+
+                // a block turned up first, so use that
+                direct = direct_state::none;
+            }
+
+            cv.wait(ul, [&]() {
+                return !blocks.empty() || eof || error;
+            });
+
+            if (blocks.empty()) {
+                // return what we've got first, and throw the error next time
+                if (error && done == 0)
+                    rethrow_exception(error);
+
+                break;
+            }
+
+            current = move(blocks.front());
+            blocks.pop_front();
+            current_off = 0;
+
+            ul.unlock();
+            cv.notify_all();
+        }
+
+        auto copy_size = min(len - done, current.size() - current_off);
+
+        memcpy(buf + done, current.data() + current_off, copy_size);
+
+        current_off += copy_size;
+        done += copy_size;
+        position += copy_size;
+    }
+
+    return done;
+}
+
+void readahead_decoder::seek(uint64_t off) {
+    if (off == position)
+        return;
+
+    // within the block we're reading
+
+    if (off < position ? position - off <= current_off : off - position <= current.size() - current_off) {
+        current_off = (size_t)(current_off + off - position);
+        position = off;
+        return;
+    }
+
+    stop();
+
+    inner->seek(off);
+    position = off;
+
+    start();
+}
+
+optional<uint64_t> readahead_decoder::size() const {
+    return inner->size();
+}
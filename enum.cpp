@@ -49,27 +49,51 @@ ULONG shell_enum::Release() {
 
 HRESULT shell_enum::Next(ULONG celt, PITEMID_CHILD* rgelt, ULONG* pceltFetched) {
     try {
+        ULONG fetched = 0;
+
         if (pceltFetched)
             *pceltFetched = 0;
 
         // FIXME - SHCONTF_INCLUDEHIDDEN
 
-        while (celt > 0 && it != root->children.end()) {
-            if (!(flags & SHCONTF_FOLDERS) && it->dir) {
-                it++;
-                continue;
+        // If the archive is still being scanned, we wait for more entries
+        // rather than telling the caller there aren't any - but only until
+        // we've got one, so that Explorer can show them as they turn up. A
+        // short batch then gets S_OK, as S_FALSE means there's nothing more
+        // to come, which we only know once the scan has finished.
+
+        while (celt > 0) {
+            auto c = tar->wait_for_child(*root, pos, fetched == 0);
+
+            if (!c) {
+                if (fetched > 0)
+                    return S_OK;
+
+                break;
             }
 
-            if (!(flags & SHCONTF_NONFOLDERS) && !it->dir) {
-                it++;
+            pos++;
+
+            if (!(flags & SHCONTF_FOLDERS) && c->dir)
+                continue;
+
+            if (!(flags & SHCONTF_NONFOLDERS) && !c->dir)
                 continue;
+
+            // Look up the type name now, while we're on Explorer's enumeration
+            // thread, so the view doesn't have to when it draws the Type column.
+
+            try {
+                c->get_type_name();
+            } catch (const last_error&) {
+                // not a problem - GetDetailsEx will report it, if it happens again
             }
 
-            *rgelt = it->make_pidl_child();
+            *rgelt = c->make_pidl_child(tar->generation);
 
             rgelt++;
             celt--;
-            it++;
+            fetched++;
 
             if (pceltFetched)
                 (*pceltFetched)++;
@@ -86,7 +110,7 @@ HRESULT shell_enum::Skip(ULONG celt) {
 }
 
 HRESULT shell_enum::Reset() {
-    it = root->children.begin();
+    pos = 0;
 
     return S_OK;
 }
@@ -20,6 +20,8 @@
 #include <shlobj.h>
 #include <ntquery.h>
 #include <span>
+#include <algorithm>
+#include <numeric>
 
 using namespace std;
 
@@ -32,11 +34,12 @@ static int date_compare(const tar_item& item1, const tar_item& item2);
 static int user_compare(const tar_item& item1, const tar_item& item2);
 static int group_compare(const tar_item& item1, const tar_item& item2);
 static int mode_compare(const tar_item& item1, const tar_item& item2);
+static u16string type_name(const tar_item& item);
 
 static const header_info headers[] = {
     { IDS_NAME, LVCFMT_LEFT, 15, &FMTID_Storage, PID_STG_NAME, name_compare, SHCOLSTATE_TYPE_STR | SHCOLSTATE_ONBYDEFAULT, false },
     { IDS_SIZE, LVCFMT_RIGHT, 10, &FMTID_Storage, PID_STG_SIZE, size_compare, SHCOLSTATE_TYPE_INT | SHCOLSTATE_ONBYDEFAULT, false },
-    { IDS_TYPE, LVCFMT_LEFT, 10, &FMTID_Storage, PID_STG_STORAGETYPE, type_compare, SHCOLSTATE_TYPE_STR | SHCOLSTATE_ONBYDEFAULT, false },
+    { IDS_TYPE, LVCFMT_LEFT, 10, &FMTID_Storage, PID_STG_STORAGETYPE, type_compare, SHCOLSTATE_TYPE_STR | SHCOLSTATE_ONBYDEFAULT, false, type_name },
     { IDS_MODIFIED, LVCFMT_LEFT, 14, &FMTID_Storage, PID_STG_WRITETIME, date_compare, SHCOLSTATE_TYPE_DATE | SHCOLSTATE_ONBYDEFAULT, false },
     { IDS_USER, LVCFMT_LEFT, 8, &FMTID_POSIXAttributes, PID_POSIX_USER, user_compare, SHCOLSTATE_TYPE_STR | SHCOLSTATE_ONBYDEFAULT, true },
     { IDS_GROUP, LVCFMT_LEFT, 8, &FMTID_POSIXAttributes, PID_POSIX_GROUP, group_compare, SHCOLSTATE_TYPE_STR | SHCOLSTATE_ONBYDEFAULT, true },
@@ -148,7 +151,7 @@ HRESULT shell_folder::ParseDisplayName(HWND hwnd, IBindCtx* pbc, LPWSTR pszDispl
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -165,9 +168,7 @@ HRESULT shell_folder::ParseDisplayName(HWND hwnd, IBindCtx* pbc, LPWSTR pszDispl
         *pchEaten = 0;
 
     for (const auto& p : parts) {
-        tar_item* c;
-
-        r->find_child(p, &c);
+        auto c = tar->find_child(*r, p);
 
         if (!c)
             break;
@@ -189,27 +190,12 @@ HRESULT shell_folder::ParseDisplayName(HWND hwnd, IBindCtx* pbc, LPWSTR pszDispl
 
     // create PIDL
 
-    size_t pidl_length = offsetof(ITEMIDLIST, mkid.abID);
-
-    for (auto fl : found_list) {
-        pidl_length += offsetof(ITEMIDLIST, mkid.abID) + fl->name.length();
-    }
-
-    auto pidl = (ITEMIDLIST*)CoTaskMemAlloc(pidl_length);
-
-    if (!pidl)
+    try {
+        *ppidl = found_list.back()->make_relative_pidl(root, tar->generation);
+    } catch (const bad_alloc&) {
         return E_OUTOFMEMORY;
-
-    *ppidl = pidl;
-
-    for (auto fl : found_list) {
-        pidl->mkid.cb = offsetof(ITEMIDLIST, mkid.abID) + fl->name.length();
-        memcpy(pidl->mkid.abID, fl->name.data(), fl->name.length());
-        pidl = (ITEMIDLIST*)((uint8_t*)pidl + pidl->mkid.cb);
     }
 
-    pidl->mkid.cb = 0;
-
     if (pdwAttributes && found_list.size() == parts.size())
         *pdwAttributes &= found_list.back()->get_atts();
 
@@ -221,7 +207,7 @@ HRESULT shell_folder::EnumObjects(HWND hwnd, SHCONTF grfFlags, IEnumIDList** ppe
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -240,7 +226,7 @@ HRESULT shell_folder::BindToObject(PCUIDLIST_RELATIVE pidl, IBindCtx* pbc, REFII
     if (riid == IID_IShellFolder) {
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -254,18 +240,9 @@ HRESULT shell_folder::BindToObject(PCUIDLIST_RELATIVE pidl, IBindCtx* pbc, REFII
             const SHITEMID* sh = &pidl->mkid;
 
             while (sh->cb != 0) {
-                string_view name{(char*)sh->abID, sh->cb - offsetof(SHITEMID, abID)};
-                bool found = false;
-
-                for (auto& it : item->children) {
-                    if (it.name == name) {
-                        found = true;
-                        item = &it;
-                        break;
-                    }
-                }
+                item = tar->get_child(*item, *sh);
 
-                if (!found)
+                if (!item)
                     return E_NOINTERFACE;
 
                 sh = (SHITEMID*)((uint8_t*)sh + sh->cb);
@@ -288,7 +265,7 @@ HRESULT shell_folder::BindToObject(PCUIDLIST_RELATIVE pidl, IBindCtx* pbc, REFII
 
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -300,18 +277,9 @@ HRESULT shell_folder::BindToObject(PCUIDLIST_RELATIVE pidl, IBindCtx* pbc, REFII
         const SHITEMID* sh = &pidl->mkid;
 
         while (sh->cb != 0) {
-            string_view name{(char*)sh->abID, sh->cb - offsetof(SHITEMID, abID)};
-            bool found = false;
+            item = tar->get_child(*item, *sh);
 
-            for (auto& it : item->children) {
-                if (it.name == name) {
-                    found = true;
-                    item = &it;
-                    break;
-                }
-            }
-
-            if (!found)
+            if (!item)
                 return E_NOINTERFACE;
 
             sh = (SHITEMID*)((uint8_t*)sh + sh->cb);
@@ -364,29 +332,12 @@ static int size_compare(const tar_item& item1, const tar_item& item2) {
         return 0;
 }
 
-static int type_compare(const tar_item& item1, const tar_item& item2) {
-    SHFILEINFOW sfi;
-    u16string type1, type2;
-
-    if (!SHGetFileInfoW((LPCWSTR)utf8_to_utf16(item1.name).c_str(),
-                        item1.dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL,
-                        &sfi, sizeof(sfi),
-                        SHGFI_USEFILEATTRIBUTES | SHGFI_TYPENAME)) {
-        throw last_error("SHGetFileInfo", GetLastError());
-    }
-
-    type1 = (char16_t*)sfi.szTypeName;
-
-    if (!SHGetFileInfoW((LPCWSTR)utf8_to_utf16(item2.name).c_str(),
-                        item2.dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL,
-                        &sfi, sizeof(sfi),
-                        SHGFI_USEFILEATTRIBUTES | SHGFI_TYPENAME)) {
-        throw last_error("SHGetFileInfo", GetLastError());
-    }
-
-    type2 = (char16_t*)sfi.szTypeName;
+static u16string type_name(const tar_item& item) {
+    return item.get_type_name();
+}
 
-    auto val = type1.compare(type2);
+static int type_compare(const tar_item& item1, const tar_item& item2) {
+    auto val = type_name(item1).compare(type_name(item2));
 
     if (val < 0)
         return -1;
@@ -411,26 +362,34 @@ static int date_compare(const tar_item& item1, const tar_item& item2) {
         return 0;
 }
 
-static int user_compare(const tar_item& item1, const tar_item& item2) {
-    auto val = item1.user.compare(item2.user);
+// Owners only get ranked once the scan has finished, as new ones can turn up
+// at any time before that. Ranks are in the same order as names, so we can
+// fall back to comparing the names.
 
-    if (val < 0)
+static int owner_compare(const tar_owner& owner1, const tar_owner& owner2) {
+    auto rank1 = owner1.rank.load();
+    auto rank2 = owner2.rank.load();
+
+    if (rank1 == TAR_OWNER_UNRANKED || rank2 == TAR_OWNER_UNRANKED) {
+        auto val = owner1.name.compare(owner2.name);
+
+        return val < 0 ? -1 : (val > 0 ? 1 : 0);
+    }
+
+    if (rank1 < rank2)
         return -1;
-    else if (val > 0)
+    else if (rank2 < rank1)
         return 1;
     else
         return 0;
 }
 
-static int group_compare(const tar_item& item1, const tar_item& item2) {
-    auto val = item1.group.compare(item2.group);
+static int user_compare(const tar_item& item1, const tar_item& item2) {
+    return owner_compare(*item1.user, *item2.user);
+}
 
-    if (val < 0)
-        return -1;
-    else if (val > 0)
-        return 1;
-    else
-        return 0;
+static int group_compare(const tar_item& item1, const tar_item& item2) {
+    return owner_compare(*item1.group, *item2.group);
 }
 
 static int mode_compare(const tar_item& item1, const tar_item& item2) {
@@ -446,29 +405,61 @@ tar_item& shell_folder::get_item_from_relative_pidl(PCUIDLIST_RELATIVE pidl) {
     tar_item* r = root;
 
     while (pidl->mkid.cb != 0) {
-        bool found = false;
-
         if (pidl->mkid.cb < offsetof(ITEMIDLIST, mkid.abID))
             throw invalid_argument("");
 
-        string_view sv{(char*)pidl->mkid.abID, pidl->mkid.cb - offsetof(ITEMIDLIST, mkid.abID)};
-
-        for (auto& it : r->children) {
-            if (it.name == sv) {
-                r = &it;
-                found = true;
-                pidl = (ITEMIDLIST*)((uint8_t*)pidl + pidl->mkid.cb);
-                break;
-            }
-        }
+        r = tar->get_child(*r, pidl->mkid);
 
-        if (!found)
+        if (!r)
             throw invalid_argument("");
+
+        pidl = (ITEMIDLIST*)((uint8_t*)pidl + pidl->mkid.cb);
     }
 
     return *r;
 }
 
+// Returns the rank of each child when sorted by the given column, with equal
+// children getting equal ranks. If the column has a sort key, we work it out
+// once for each child rather than twice for each comparison.
+
+static vector<uint32_t> rank_children(const vector<tar_item*>& children, const header_info& h) {
+    vector<uint32_t> order(children.size()), ranks(children.size());
+    vector<u16string> keys;
+    function<int(uint32_t, uint32_t)> cmp;
+
+    iota(order.begin(), order.end(), 0);
+
+    if (h.sort_key) {
+        keys.reserve(children.size());
+
+        for (auto c : children) {
+            keys.emplace_back(h.sort_key(*c));
+        }
+
+        cmp = [&](uint32_t a, uint32_t b) {
+            return keys[a].compare(keys[b]);
+        };
+    } else {
+        cmp = [&](uint32_t a, uint32_t b) {
+            return h.compare_func(*children[a], *children[b]);
+        };
+    }
+
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return cmp(a, b) < 0;
+    });
+
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || cmp(order[i - 1], order[i]) != 0)
+            ranks[order[i]] = (uint32_t)i;
+        else
+            ranks[order[i]] = ranks[order[i - 1]];
+    }
+
+    return ranks;
+}
+
 HRESULT shell_folder::CompareIDs(LPARAM lParam, PCUIDLIST_RELATIVE pidl1, PCUIDLIST_RELATIVE pidl2) {
     debug("shell_folder::CompareIDs({}, {}, {})\n", lParam, (void*)pidl1, (void*)pidl2);
 
@@ -477,7 +468,7 @@ HRESULT shell_folder::CompareIDs(LPARAM lParam, PCUIDLIST_RELATIVE pidl1, PCUIDL
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -500,7 +491,20 @@ HRESULT shell_folder::CompareIDs(LPARAM lParam, PCUIDLIST_RELATIVE pidl1, PCUIDL
             tar_item& item1 = get_item_from_relative_pidl(pidl1);
             tar_item& item2 = get_item_from_relative_pidl(pidl2);
 
-            res = h[col].compare_func(item1, item2);
+            if (item1.parent && item1.parent == item2.parent) {
+                auto ranks = tar->get_sort_ranks(*item1.parent, col, [&](const vector<tar_item*>& children) {
+                    return rank_children(children, h[col]);
+                });
+
+                if (ranks && item1.child_num < ranks->size() && item2.child_num < ranks->size()) {
+                    auto rank1 = (*ranks)[item1.child_num];
+                    auto rank2 = (*ranks)[item2.child_num];
+
+                    res = rank1 < rank2 ? -1 : (rank1 > rank2 ? 1 : 0);
+                } else
+                    res = h[col].compare_func(item1, item2);
+            } else
+                res = h[col].compare_func(item1, item2);
         }
 
         return MAKE_HRESULT(SEVERITY_SUCCESS, 0, res == -1 ? 0xffff : res);
@@ -519,7 +523,7 @@ HRESULT shell_folder::CreateViewObject(HWND hwndOwner, REFIID riid, void **ppv)
 
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -543,14 +547,12 @@ tar_item& shell_folder::get_item_from_pidl_child(const ITEMID_CHILD* pidl) {
     if (pidl->mkid.cb < offsetof(ITEMIDLIST, mkid.abID))
         throw invalid_argument("");
 
-    string_view sv{(char*)pidl->mkid.abID, pidl->mkid.cb - offsetof(ITEMIDLIST, mkid.abID)};
+    auto item = tar->get_child(*root, pidl->mkid);
 
-    for (auto& it : root->children) {
-        if (it.name == sv)
-            return it;
-    }
+    if (!item)
+        throw invalid_argument("");
 
-    throw invalid_argument("");
+    return *item;
 }
 
 HRESULT shell_folder::GetAttributesOf(UINT cidl, PCUITEMID_CHILD_ARRAY apidl, SFGAOF* rgfInOut) {
@@ -558,7 +560,7 @@ HRESULT shell_folder::GetAttributesOf(UINT cidl, PCUITEMID_CHILD_ARRAY apidl, SF
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -598,7 +600,7 @@ HRESULT shell_folder::GetUIObjectOf(HWND hwndOwner, UINT cidl, PCUITEMID_CHILD_A
     if (riid == IID_IExtractIconW || riid == IID_IExtractIconA) {
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -621,7 +623,7 @@ HRESULT shell_folder::GetUIObjectOf(HWND hwndOwner, UINT cidl, PCUITEMID_CHILD_A
     } else if (riid == IID_IContextMenu || riid == IID_IDataObject) {
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -660,7 +662,7 @@ HRESULT shell_folder::GetDisplayNameOf(PCUITEMID_CHILD pidl, SHGDNF uFlags, STRR
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -728,7 +730,7 @@ HRESULT shell_folder::GetDefaultColumnState(UINT iColumn, SHCOLSTATEF* pcsFlags)
     if (h[iColumn].tarball_only) {
         if (!tar) {
             try {
-                tar.reset(new tar_info(path));
+                tar = tar_cache.get(path);
 
                 root = &tar->root;
             } catch (const exception& e) {
@@ -754,7 +756,7 @@ HRESULT shell_folder::GetDetailsEx(PCUITEMID_CHILD pidl, const SHCOLUMNID* pscid
 
     if (!tar) {
         try {
-            tar.reset(new tar_info(path));
+            tar = tar_cache.get(path);
 
             root = &tar->root;
         } catch (const exception& e) {
@@ -782,21 +784,12 @@ HRESULT shell_folder::GetDetailsEx(PCUITEMID_CHILD pidl, const SHCOLUMNID* pscid
 
                     return S_OK;
 
-                case PID_STG_STORAGETYPE: {
-                    SHFILEINFOW sfi;
-
-                    if (!SHGetFileInfoW((LPCWSTR)utf8_to_utf16(item.name).c_str(),
-                                        item.dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL,
-                                        &sfi, sizeof(sfi),
-                                        SHGFI_USEFILEATTRIBUTES | SHGFI_TYPENAME)) {
-                        throw last_error("SHGetFileInfo", GetLastError());
-                    }
-
+                case PID_STG_STORAGETYPE:
                     pv->vt = VT_BSTR;
-                    pv->bstrVal = SysAllocString(sfi.szTypeName);
+                    pv->bstrVal = SysAllocString((WCHAR*)item.get_type_name().c_str());
 
                     return S_OK;
-                }
+
 
                 case PID_STG_WRITETIME: {
                     if (!item.mtime.has_value())
@@ -818,7 +811,7 @@ HRESULT shell_folder::GetDetailsEx(PCUITEMID_CHILD pidl, const SHCOLUMNID* pscid
                         return E_FAIL;
 
                     pv->vt = VT_BSTR;
-                    pv->bstrVal = SysAllocString((WCHAR*)utf8_to_utf16(item.user).c_str());
+                    pv->bstrVal = SysAllocString((WCHAR*)utf8_to_utf16(item.user->name).c_str());
 
                     return S_OK;
 
@@ -827,7 +820,7 @@ HRESULT shell_folder::GetDetailsEx(PCUITEMID_CHILD pidl, const SHCOLUMNID* pscid
                         return E_FAIL;
 
                     pv->vt = VT_BSTR;
-                    pv->bstrVal = SysAllocString((WCHAR*)utf8_to_utf16(item.group).c_str());
+                    pv->bstrVal = SysAllocString((WCHAR*)utf8_to_utf16(item.group->name).c_str());
 
                     return S_OK;
 
@@ -994,7 +987,7 @@ HRESULT shell_folder::InitializeEx(IBindCtx* pbc, PCIDLIST_ABSOLUTE pidlRoot, co
 
     this->path = path;
 
-    tar.reset();
+    tar_cache.release(tar);
 
     if (root_pidl)
         ILFree(root_pidl);
@@ -1043,6 +1036,8 @@ shell_folder::shell_folder(const std::shared_ptr<tar_info>& tar, tar_item* root,
 }
 
 shell_folder::~shell_folder() {
+    tar_cache.release(tar);
+
     if (root_pidl)
         CoTaskMemFree(root_pidl);
 }
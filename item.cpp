@@ -145,7 +145,7 @@ HRESULT shell_item_list::QueryContextMenu(HMENU hmenu, UINT indexMenu, UINT idCm
     return MAKE_HRESULT(SEVERITY_SUCCESS, FACILITY_NULL, cmd - idCmdFirst);
 }
 
-static filesystem::path get_temp_file_name(const filesystem::path& dir, const u16string& prefix, unsigned int unique) {
+filesystem::path get_temp_file_name(const filesystem::path& dir, const u16string& prefix, unsigned int unique) {
     WCHAR tmpfn[MAX_PATH];
 
     if (GetTempFileNameW((WCHAR*)dir.u16string().c_str(), (WCHAR*)prefix.c_str(), unique, tmpfn) == 0)
@@ -159,7 +159,7 @@ HRESULT shell_item_list::open_cmd(CMINVOKECOMMANDINFO* pici) {
         if (item->dir) {
             SHELLEXECUTEINFOW sei;
 
-            auto child_pidl = item->make_pidl_child();
+            auto child_pidl = item->make_pidl_child(tar->generation);
             auto pidl = ILCombine(root_pidl, child_pidl);
 
             ILFree(child_pidl);
@@ -234,7 +234,7 @@ u16string shell_item_list::get_item_prop(tar_item& item, const GUID& fmtid, DWOR
     u16string val;
     SHCOLUMNID scid;
     VARIANT v;
-    auto pidl = item.make_pidl_child();
+    auto pidl = item.make_pidl_child(tar->generation);
 
     VariantInit(&v);
 
@@ -269,25 +269,14 @@ u16string shell_item_list::get_item_prop(tar_item& item, const GUID& fmtid, DWOR
     return val;
 }
 
-static uint64_t calc_size_dir(const tar_item& item) {
-    uint64_t size = 0;
-
-    for (const auto& c : item.children) {
-        if (c.dir)
-            size += calc_size_dir(c);
-        else
-            size += c.size;
-    }
-
-    return size;
-}
-
 uint64_t shell_item_list::calc_size() {
     uint64_t size = 0;
 
+    // If the archive is still being scanned, this is what we've found so far.
+
     for (auto item : itemlist) {
         if (item->dir)
-            size += calc_size_dir(*item);
+            size += tar->get_totals(*item).size;
         else
             size += item->size;
     }
@@ -307,7 +296,7 @@ INT_PTR shell_item_list::PropSheetDlgProc(HWND hwndDlg, UINT uMsg, WPARAM wParam
                     IExtractIconW* ieiw;
                     ITEMIDLIST* apidl[1];
 
-                    apidl[0] = itemlist[0]->make_relative_pidl(root);
+                    apidl[0] = itemlist[0]->make_relative_pidl(root, tar->generation);
 
                     hr = folder->GetUIObjectOf(hwndDlg, 1, (PCUITEMID_CHILD_ARRAY)apidl, IID_IExtractIconW, nullptr, (void**)&ieiw);
                     if (!FAILED(hr)) {
@@ -597,8 +586,8 @@ void shell_item_list::populate_full_itemlist2(tar_item* item, const u16string& p
 
     full_itemlist.emplace_back(item, name);
 
-    for (auto& c : item->children) {
-        populate_full_itemlist2(&c, name + u"\\");
+    for (auto c : item->children) {
+        populate_full_itemlist2(c, name + u"\\");
     }
 }
 
@@ -611,11 +600,25 @@ void shell_item_list::populate_full_itemlist() {
         return;
     }
 
+    tar->wait();
+
     for (auto item : itemlist) {
         populate_full_itemlist2(item, u"");
     }
 }
 
+// Files we can't get to directly - those we'd have to decompress from the start
+// of the archive to find - go through a session shared by all the streams, so
+// that we only make one pass through the archive. We can seek within xz files,
+// but only to the start of a block, and most only have the one.
+
+static bool needs_session(const tar_info& tar, const tar_item& item) {
+    if (!(tar.type & archive_type::tarball) || item.dir)
+        return false;
+
+    return !tar.scan_finished() || item.data_offset == -1 || tar.type & archive_type::xz;
+}
+
 HRESULT shell_item_list::GetData(FORMATETC* pformatetcIn, STGMEDIUM* pmedium) {
     char16_t format[256];
 
@@ -654,9 +657,26 @@ HRESULT shell_item_list::GetData(FORMATETC* pformatetcIn, STGMEDIUM* pmedium) {
             return E_INVALIDARG;
 
         try {
-            auto tis = new tar_item_stream(tar, *full_itemlist[pformatetcIn->lindex].item);
+            auto& item = *full_itemlist[pformatetcIn->lindex].item;
+            tar_item_stream* tis;
             HRESULT hr;
 
+            if (needs_session(*tar, item)) {
+                if (!session) {
+                    vector<tar_item*> items;
+
+                    for (const auto& d : full_itemlist) {
+                        if (needs_session(*tar, *d.item))
+                            items.push_back(d.item);
+                    }
+
+                    session = make_shared<extract_session>(tar, items);
+                }
+
+                tis = new tar_item_stream(tar, item, session);
+            } else
+                tis = new tar_item_stream(tar, item);
+
             pmedium->tymed = TYMED_ISTREAM;
 
             hr = tis->QueryInterface(IID_IStream, (void**)&pmedium->pstm);
@@ -692,7 +712,7 @@ HGLOBAL shell_item_list::make_shell_id_list() {
     size = offsetof(CIDA, aoffset) + (sizeof(UINT) * (full_itemlist.size() + 1)) + root_pidl_size;
 
     for (const auto& item : full_itemlist) {
-        auto child_pidl = item.item->make_relative_pidl(root);
+        auto child_pidl = item.item->make_relative_pidl(root, tar->generation);
 
         size += ILGetSize(child_pidl);
 
@@ -716,7 +736,7 @@ HGLOBAL shell_item_list::make_shell_id_list() {
     off++;
 
     for (const auto& item : full_itemlist) {
-        auto child_pidl = item.item->make_relative_pidl(root);
+        auto child_pidl = item.item->make_relative_pidl(root, tar->generation);
         size_t child_pidl_size = ILGetSize(child_pidl);
 
         *off = ptr - (uint8_t*)cida;
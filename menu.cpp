@@ -24,6 +24,8 @@ using namespace std;
 #define HIDA_GetPIDLFolder(pida) (LPCITEMIDLIST)(((LPBYTE)pida)+(pida)->aoffset[0])
 #define HIDA_GetPIDLItem(pida, i) (LPCITEMIDLIST)(((LPBYTE)pida)+(pida)->aoffset[i+1])
 
+#define DECOMPRESS_BUFFER_SIZE 1048576
+
 HRESULT shell_context_menu::QueryInterface(REFIID iid, void** ppv) {
     if (iid == IID_IUnknown || iid == IID_IContextMenu)
         *ppv = static_cast<IContextMenu*>(this);
@@ -150,11 +152,11 @@ void shell_context_menu::extract_all(CMINVOKECOMMANDINFO* pici) {
                 if (!SHGetPathFromIDListW((ITEMIDLIST*)get<0>(file).data(), path))
                     throw runtime_error("SHGetPathFromIDList failed");
 
-                shared_ptr<tar_info> ti{new tar_info(path)};
+                auto ti = tar_cache.get(path);
 
-                for (auto& item : ti->root.children) {
-                    itemlist.push_back(&item);
-                }
+                ti->wait();
+
+                itemlist = ti->root.children;
 
                 shell_items.emplace_back((ITEMIDLIST*)get<0>(file).data(), ti, itemlist, &ti->root, false, nullptr);
             }
@@ -244,7 +246,7 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
         if (type & archive_type::gzip) {
             int ret;
             z_stream strm;
-            uint8_t inbuf[4096], outbuf[4096];
+            vector<uint8_t> inbuf(DECOMPRESS_BUFFER_SIZE), outbuf(DECOMPRESS_BUFFER_SIZE);
 
             // FIXME - can we do this via IStream rather than CreateFile etc.?
 
@@ -258,16 +260,16 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
 
             strm.next_in = nullptr;
             strm.avail_in = 0;
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
+            strm.next_out = outbuf.data();
+            strm.avail_out = (unsigned int)outbuf.size();
 
             while (true) {
                 if (strm.avail_in == 0) {
                     ULONG read;
 
-                    strm.next_in = inbuf;
+                    strm.next_in = inbuf.data();
 
-                    hr = stream->Read(inbuf, sizeof(inbuf), &read);
+                    hr = stream->Read(inbuf.data(), (ULONG)inbuf.size(), &read);
                     if (FAILED(hr))
                         throw formatted_error("IStream::Read returned {:08x}.", (uint32_t)hr);
 
@@ -284,13 +286,13 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
                 if (strm.avail_out == 0 || ret == Z_STREAM_END) {
                     DWORD written;
 
-                    if (!WriteFile(h.get(), outbuf, sizeof(outbuf) - strm.avail_out, &written, nullptr))
+                    if (!WriteFile(h.get(), outbuf.data(), (DWORD)(outbuf.size() - strm.avail_out), &written, nullptr))
                         throw last_error("WriteFile", GetLastError());
                 }
 
                 if (strm.avail_out == 0) {
-                    strm.next_out = outbuf;
-                    strm.avail_out = sizeof(outbuf);
+                    strm.next_out = outbuf.data();
+                    strm.avail_out = (unsigned int)outbuf.size();
                 }
 
                 if (ret == Z_STREAM_END)
@@ -299,7 +301,7 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
         } else if (type & archive_type::bz2) {
             int ret;
             bz_stream strm;
-            char inbuf[4096], outbuf[4096];
+            vector<char> inbuf(DECOMPRESS_BUFFER_SIZE), outbuf(DECOMPRESS_BUFFER_SIZE);
 
             strm.bzalloc = nullptr;
             strm.bzfree = nullptr;
@@ -311,16 +313,16 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
 
             strm.next_in = nullptr;
             strm.avail_in = 0;
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
+            strm.next_out = outbuf.data();
+            strm.avail_out = (unsigned int)outbuf.size();
 
             while (true) {
                 if (strm.avail_in == 0) {
                     ULONG read;
 
-                    strm.next_in = inbuf;
+                    strm.next_in = inbuf.data();
 
-                    hr = stream->Read(inbuf, sizeof(inbuf), &read);
+                    hr = stream->Read(inbuf.data(), (ULONG)inbuf.size(), &read);
                     if (FAILED(hr))
                         throw formatted_error("IStream::Read returned {:08x}.", (uint32_t)hr);
 
@@ -337,13 +339,13 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
                 if (strm.avail_out == 0 || ret == BZ_STREAM_END) {
                     DWORD written;
 
-                    if (!WriteFile(h.get(), outbuf, sizeof(outbuf) - strm.avail_out, &written, nullptr))
+                    if (!WriteFile(h.get(), outbuf.data(), (DWORD)(outbuf.size() - strm.avail_out), &written, nullptr))
                         throw last_error("WriteFile", GetLastError());
                 }
 
                 if (strm.avail_out == 0) {
-                    strm.next_out = outbuf;
-                    strm.avail_out = sizeof(outbuf);
+                    strm.next_out = outbuf.data();
+                    strm.avail_out = (unsigned int)outbuf.size();
                 }
 
                 if (ret == BZ_STREAM_END)
@@ -352,52 +354,79 @@ static void decompress_file(ITEMIDLIST* pidl, archive_type type) {
         } else if (type & archive_type::xz) {
             int ret;
             lzma_stream strm = LZMA_STREAM_INIT;
-            uint8_t inbuf[4096], outbuf[4096];
+            vector<uint8_t> inbuf(DECOMPRESS_BUFFER_SIZE), outbuf(DECOMPRESS_BUFFER_SIZE);
+
+#if LZMA_VERSION >= 50040002 // 5.4.0, the first stable version with the threaded decoder
+            lzma_mt mt;
+
+            // liblzma falls back to decompressing on one thread if the file
+            // only has one block, or if threading would use too much memory
 
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = xz_threads();
+            mt.memlimit_threading = xz_memory_limit();
+            mt.memlimit_stop = UINT64_MAX;
+
+            ret = lzma_stream_decoder_mt(&strm, &mt);
+            if (ret != LZMA_OK)
+                throw formatted_error("lzma_stream_decoder_mt returned {}.", ret);
+#else
             ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
             if (ret != LZMA_OK)
                 throw formatted_error("lzma_stream_decoder returned {}.", ret);
+#endif
 
-            strm.next_in = nullptr;
-            strm.avail_in = 0;
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
+            try {
+                bool eof = false;
 
-            while (true) {
-                if (strm.avail_in == 0) {
-                    ULONG read;
+                strm.next_in = nullptr;
+                strm.avail_in = 0;
+                strm.next_out = outbuf.data();
+                strm.avail_out = (unsigned int)outbuf.size();
 
-                    strm.next_in = inbuf;
+                // the other threads may still have output for us once we've reached the end of the input
 
-                    hr = stream->Read(inbuf, sizeof(inbuf), &read);
-                    if (FAILED(hr))
-                        throw formatted_error("IStream::Read returned {:08x}.", (uint32_t)hr);
+                while (true) {
+                    if (strm.avail_in == 0 && !eof) {
+                        ULONG read;
 
-                    strm.avail_in = read;
+                        strm.next_in = inbuf.data();
 
-                    if (read == 0) // end of file
-                        break;
-                }
+                        hr = stream->Read(inbuf.data(), (ULONG)inbuf.size(), &read);
+                        if (FAILED(hr))
+                            throw formatted_error("IStream::Read returned {:08x}.", (uint32_t)hr);
 
-                ret = lzma_code(&strm, LZMA_RUN);
-                if (ret != LZMA_OK && ret != LZMA_STREAM_END)
-                    throw formatted_error("lzma_code returned {}.", ret);
+                        strm.avail_in = read;
 
-                if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
-                    DWORD written;
+                        if (read == 0) // end of file
+                            eof = true;
+                    }
 
-                    if (!WriteFile(h.get(), outbuf, sizeof(outbuf) - strm.avail_out, &written, nullptr))
-                        throw last_error("WriteFile", GetLastError());
-                }
+                    ret = lzma_code(&strm, eof ? LZMA_FINISH : LZMA_RUN);
+                    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                        throw formatted_error("lzma_code returned {}.", ret);
 
-                if (strm.avail_out == 0) {
-                    strm.next_out = outbuf;
-                    strm.avail_out = sizeof(outbuf);
-                }
+                    if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+                        DWORD written;
 
-                if (ret == LZMA_STREAM_END)
-                    break;
+                        if (!WriteFile(h.get(), outbuf.data(), (DWORD)(outbuf.size() - strm.avail_out), &written, nullptr))
+                            throw last_error("WriteFile", GetLastError());
+                    }
+
+                    if (strm.avail_out == 0) {
+                        strm.next_out = outbuf.data();
+                        strm.avail_out = (unsigned int)outbuf.size();
+                    }
+
+                    if (ret == LZMA_STREAM_END)
+                        break;
+                }
+            } catch (...) {
+                lzma_end(&strm);
+                throw;
             }
+
+            lzma_end(&strm);
         }
 
         stream.reset(); // close IStream
@@ -20,16 +20,14 @@
 using namespace std;
 
 #define BLOCK_SIZE 20480
+#define COPY_BUFFER_SIZE 1048576
 
 tar_item_stream::~tar_item_stream() {
+    if (session)
+        session->release(item);
+
     if (a)
         archive_read_free(a);
-
-    if (gzf)
-        gzclose(gzf);
-
-    if (type & archive_type::xz)
-        lzma_end(&xz_strm);
 }
 
 HRESULT tar_item_stream::QueryInterface(REFIID iid, void** ppv) {
@@ -72,170 +70,124 @@ HRESULT tar_item_stream::Read(void* pv, ULONG cb, ULONG* pcbRead) {
 
     *pcbRead = 0;
 
-    if (!buf.empty()) {
-        size_t copy_size = min(buf.size(), (size_t)cb);
+    if (!pending.empty()) {
+        size_t copy_size = min(pending.size(), (size_t)cb);
 
-        if (copy_size > 0) {
-            memcpy(pv, buf.data(), copy_size);
-            buf = buf.substr(copy_size);
+        memcpy(pv, pending.data(), copy_size);
+        pending = pending.subspan(copy_size);
 
-            cb -= copy_size;
-            *pcbRead += copy_size;
-            position += copy_size;
-            pv = (uint8_t*)pv + copy_size;
-        }
+        cb -= copy_size;
+        *pcbRead += copy_size;
+        position += copy_size;
+        pv = (uint8_t*)pv + copy_size;
     }
 
     if (cb == 0)
         return S_OK;
 
-    if (type & archive_type::tarball) {
-        while (cb > 0) {
-            auto r = archive_read_data_block(a, &readbuf, &size, &offset);
-
-            if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
-                throw runtime_error(archive_error_string(a));
+    if (session) {
+        auto read = position >= (uint64_t)item.size ? 0 :
+                    session->read(item, position, (uint8_t*)pv, (size_t)min((uint64_t)cb, item.size - position));
 
-            if (size == 0)
-                return S_OK;
+        if (read.has_value()) {
+            *pcbRead += (ULONG)read.value();
+            position += read.value();
 
-            copy_size = min(size, (size_t)cb);
-
-            memcpy(pv, readbuf, copy_size);
-            pv = (uint8_t*)pv + copy_size;
-            *pcbRead += copy_size;
-            position += copy_size;
-
-            if (size > cb)
-                buf.append(string_view((char*)readbuf + cb, size - cb));
-
-            cb -= copy_size;
+            return S_OK;
         }
 
-        return S_OK;
-    }
+        // The session has already gone past our file, so we'll have to find
+        // it ourselves.
 
-    switch (type) {
-        case archive_type::gzip: {
-            auto ret = gzread(gzf, pv, cb);
-
-            if (ret < 0)
-                throw formatted_error("gzread returned {}.", ret); // FIXME - use gzerror to get actual error
+        session.reset();
+        open();
+        skip(min(position, (uint64_t)item.size));
+    }
 
-            *pcbRead = ret;
-            position += ret;
+    if (dec) {
+        size_t len = cb;
 
-            break;
-        }
+        // A single compressed file goes on until the decoder runs out - we
+        // don't want to cut it short if item.size is wrong.
 
-        case archive_type::bz2: {
-            if (bz2_ret == BZ_STREAM_END)
+        if (type & archive_type::tarball) {
+            if (position >= (uint64_t)item.size)
                 return S_OK;
 
-            do {
-                if (bz2_strm.avail_in == 0 && !eof) {
-                    DWORD read;
-
-                    bz2_strm.next_in = inbuf.data();
-
-                    if (!ReadFile(h.get(), inbuf.data(), inbuf.length(), &read, nullptr))
-                        throw last_error("ReadFile", GetLastError());
-
-                    bz2_strm.avail_in = read;
-
-                    if (read == 0) // end of file
-                        eof = true;
-                }
-
-                bz2_ret = BZ2_bzDecompress(&bz2_strm);
-
-                if (bz2_ret != BZ_OK && bz2_ret != BZ_STREAM_END)
-                    throw formatted_error("BZ2_bzDecompress returned {}.", bz2_ret);
-
-                if (bz2_strm.avail_out == 0 || bz2_ret == BZ_STREAM_END) {
-                    size_t read_size = outbuf.length() - bz2_strm.avail_out;
-
-                    copy_size = min(read_size, (size_t)cb);
-
-                    memcpy(pv, outbuf.data(), copy_size);
+            len = (size_t)min((uint64_t)cb, item.size - position);
+        }
 
-                    pv = (uint8_t*)pv + copy_size;
-                    *pcbRead += copy_size;
-                    position += copy_size;
+        auto read = dec->read((uint8_t*)pv, len);
 
-                    if (read_size > cb)
-                        buf.append(string_view(outbuf).substr(cb, read_size - cb));
+        *pcbRead += (ULONG)read;
+        position += read;
 
-                    cb -= copy_size;
-                }
+        return S_OK;
+    }
 
-                if (bz2_strm.avail_out == 0) {
-                    bz2_strm.next_out = outbuf.data();
-                    bz2_strm.avail_out = outbuf.length();
-                }
-            } while (bz2_ret != BZ_STREAM_END);
+    if (type & archive_type::tarball) {
+        while (cb > 0) {
+            auto r = archive_read_data_block(a, &readbuf, &size, &offset);
 
-            break;
-        }
+            if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
+                throw runtime_error(archive_error_string(a));
 
-        case archive_type::xz: {
-            if (lzma_ret == LZMA_STREAM_END)
+            if (size == 0)
                 return S_OK;
 
-            do {
-                if (xz_strm.avail_in == 0 && !eof) {
-                    DWORD read;
-
-                    xz_strm.next_in = (uint8_t*)inbuf.data();
+            copy_size = min(size, (size_t)cb);
 
-                    if (!ReadFile(h.get(), inbuf.data(), inbuf.length(), &read, nullptr))
-                        throw last_error("ReadFile", GetLastError());
+            memcpy(pv, readbuf, copy_size);
+            pv = (uint8_t*)pv + copy_size;
+            *pcbRead += copy_size;
+            position += copy_size;
 
-                    xz_strm.avail_in = read;
+            // libarchive keeps the block around until the next call, so
+            // rather than copying what's left we just remember where it is
 
-                    if (read == 0) // end of file
-                        eof = true;
-                }
+            if (size > copy_size)
+                pending = span((const uint8_t*)readbuf + copy_size, size - copy_size);
 
-                lzma_ret = lzma_code(&xz_strm, eof ? LZMA_FINISH : LZMA_RUN);
+            cb -= copy_size;
+        }
+    }
 
-                if (lzma_ret != LZMA_OK && lzma_ret != LZMA_STREAM_END)
-                    throw formatted_error("lzma_code returned {}.", lzma_ret);
+    return S_OK;
+}
 
-                if (xz_strm.avail_out == 0 || lzma_ret == LZMA_STREAM_END) {
-                    size_t read_size = outbuf.length() - xz_strm.avail_out;
+// Throws away the next len bytes of the file.
 
-                    copy_size = min(read_size, (size_t)cb);
+void tar_item_stream::skip(uint64_t len) {
+    if (len == 0)
+        return;
 
-                    memcpy(pv, outbuf.data(), copy_size);
+    if (dec) {
+        dec->seek(dec->position + len);
+        return;
+    }
 
-                    pv = (uint8_t*)pv + copy_size;
-                    *pcbRead += copy_size;
-                    position += copy_size;
+    string scratch;
+    uint64_t left = len;
 
-                    if (read_size > cb)
-                        buf.append(string_view(outbuf).substr(cb, read_size - cb));
+    scratch.resize(BLOCK_SIZE);
 
-                    cb -= copy_size;
-                }
+    while (left > 0) {
+        auto r = archive_read_data(a, scratch.data(), (size_t)min(left, (uint64_t)scratch.size()));
 
-                if (xz_strm.avail_out == 0) {
-                    xz_strm.next_out = (uint8_t*)outbuf.data();
-                    xz_strm.avail_out = outbuf.length();
-                }
-            } while (lzma_ret != LZMA_STREAM_END);
+        if (r < 0)
+            throw formatted_error("Error skipping {} bytes.", len);
+        else if (r == 0)
+            throw formatted_error("Unexpected end of file skipping {} bytes.", len);
 
-            break;
-        }
+        left -= r;
     }
-
-    return S_OK;
 }
 
 void tar_item_stream::extract_file(const filesystem::path& fn) {
     HRESULT hr;
     char buf[BLOCK_SIZE];
-    ULONG read, total_read = 0;
+    ULONG read;
+    uint64_t total_read = 0;
 
     unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_WRITE, 0, nullptr,
                                 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr)};
@@ -268,7 +220,36 @@ HRESULT tar_item_stream::Write(const void* pv, ULONG cb, ULONG* pcbWritten) {
 HRESULT tar_item_stream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) {
     debug("tar_item_stream::Seek({}, {}, {})\n", dlibMove.QuadPart, dwOrigin, (void*)plibNewPosition);
 
-    // FIXME - currently ignoring what we're told
+    int64_t new_pos;
+
+    switch (dwOrigin) {
+        case STREAM_SEEK_SET:
+            new_pos = dlibMove.QuadPart;
+            break;
+
+        case STREAM_SEEK_CUR:
+            new_pos = (int64_t)position + dlibMove.QuadPart;
+            break;
+
+        case STREAM_SEEK_END:
+            new_pos = item.size + dlibMove.QuadPart;
+            break;
+
+        default:
+            return STG_E_INVALIDFUNCTION;
+    }
+
+    if (new_pos < 0)
+        return STG_E_INVALIDFUNCTION;
+
+    try {
+        seek_to((uint64_t)new_pos);
+    } catch (const bad_alloc&) {
+        return E_OUTOFMEMORY;
+    } catch (const exception& e) {
+        debug("tar_item_stream::Seek: {}\n", e.what());
+        return E_FAIL;
+    }
 
     if (plibNewPosition)
         plibNewPosition->QuadPart = position;
@@ -276,12 +257,151 @@ HRESULT tar_item_stream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INT
     return S_OK;
 }
 
+// Whatever we're reading from is kept at min(position, item.size), so that
+// seeking past the end and back again works.
+
+void tar_item_stream::seek_to(uint64_t pos) {
+    auto size = (uint64_t)item.size;
+    auto cur = min(position, size);
+    auto target = min(pos, size);
+
+    if (session || target == cur) {
+        // the session gets told the offset on every read
+        position = pos;
+        return;
+    }
+
+    if (dec) {
+        // decoders can go backwards, using access points if there are any
+        dec->seek(dec->position - cur + target);
+    } else if (target < cur) {
+        // libarchive can only go forwards, so start again
+
+        archive_read_free(a);
+        a = nullptr;
+        pending = {};
+
+        open();
+        skip(target);
+    } else {
+        auto n = (size_t)min((uint64_t)pending.size(), target - cur);
+
+        pending = pending.subspan(n);
+        skip(target - cur - n);
+    }
+
+    position = pos;
+}
+
 HRESULT tar_item_stream::SetSize(ULARGE_INTEGER libNewSize) {
     UNIMPLEMENTED; // FIXME
 }
 
+// If libarchive is doing the decompression, we pass its blocks straight to the
+// other stream. Otherwise we read into a big buffer - decoders write straight
+// into it, and for uncompressed tarballs this is a read from the file itself.
+
 HRESULT tar_item_stream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) {
-    UNIMPLEMENTED; // FIXME
+    HRESULT hr = S_OK;
+    uint64_t left = cb.QuadPart, total_read = 0, total_written = 0;
+
+    debug("tar_item_stream::CopyTo({}, {}, {}, {})\n", (void*)pstm, cb.QuadPart, (void*)pcbRead, (void*)pcbWritten);
+
+    if (!pstm)
+        return STG_E_INVALIDPOINTER;
+
+    if (item.dir)
+        return E_NOTIMPL;
+
+    // Returns how much got written - if it's less than len, hr says why.
+
+    auto write = [&](const void* data, size_t len) {
+        ULONG written = 0;
+
+        hr = pstm->Write(data, (ULONG)len, &written);
+
+        written = min(written, (ULONG)len);
+        total_written += written;
+
+        if (SUCCEEDED(hr) && written < len)
+            hr = STG_E_MEDIUMFULL;
+
+        return (size_t)written;
+    };
+
+    // Anything that doesn't get written is left for the next Read or CopyTo.
+
+    try {
+        if (a && !dec && !session) {
+            if (!pending.empty()) {
+                auto written = write(pending.data(), (size_t)min((uint64_t)pending.size(), left));
+
+                pending = pending.subspan(written);
+                position += written;
+                total_read += written;
+                left -= written;
+            }
+
+            while (SUCCEEDED(hr) && left > 0) {
+                const void* readbuf;
+                size_t size;
+                int64_t offset;
+
+                auto r = archive_read_data_block(a, &readbuf, &size, &offset);
+
+                if (r != ARCHIVE_OK && r != ARCHIVE_EOF)
+                    throw runtime_error(archive_error_string(a));
+
+                if (size == 0)
+                    break;
+
+                auto written = write(readbuf, (size_t)min((uint64_t)size, left));
+
+                if (size > written)
+                    pending = span((const uint8_t*)readbuf + written, size - written);
+
+                position += written;
+                total_read += written;
+                left -= written;
+            }
+        } else {
+            string copybuf;
+
+            copybuf.resize((size_t)min(left, (uint64_t)COPY_BUFFER_SIZE));
+
+            while (left > 0) {
+                ULONG read;
+
+                hr = Read(copybuf.data(), (ULONG)min(left, (uint64_t)copybuf.size()), &read);
+
+                if (FAILED(hr) || read == 0)
+                    break;
+
+                auto written = write(copybuf.data(), read);
+
+                total_read += written;
+                left -= written;
+
+                if (written < read) {
+                    seek_to(position - (read - written));
+                    break;
+                }
+            }
+        }
+    } catch (const bad_alloc&) {
+        hr = E_OUTOFMEMORY;
+    } catch (const exception& e) {
+        debug("tar_item_stream::CopyTo: {}\n", e.what());
+        hr = E_FAIL;
+    }
+
+    if (pcbRead)
+        pcbRead->QuadPart = total_read;
+
+    if (pcbWritten)
+        pcbWritten->QuadPart = total_written;
+
+    return hr;
 }
 
 HRESULT tar_item_stream::Commit(DWORD grfCommitFlags) {
@@ -335,11 +455,92 @@ HRESULT tar_item_stream::Stat(STATSTG* pstatstg, DWORD grfStatFlag) {
     return S_OK;
 }
 
+// The clone opens the file again, but as open uses the item's data offset and
+// the archive's access points, this doesn't mean starting from the beginning.
+// If we're part of an extraction session, so is the clone.
+
 HRESULT tar_item_stream::Clone(IStream** ppstm) {
-    UNIMPLEMENTED; // FIXME
+    if (!ppstm)
+        return STG_E_INVALIDPOINTER;
+
+    try {
+        unique_ptr<tar_item_stream> tis;
+
+        if (session)
+            tis.reset(new tar_item_stream(tar, item, session));
+        else
+            tis.reset(new tar_item_stream(tar, item));
+
+        tis->seek_to(position);
+
+        auto hr = tis->QueryInterface(IID_IStream, (void**)ppstm);
+        if (FAILED(hr))
+            return hr;
+
+        tis.release();
+
+        return S_OK;
+    } catch (const bad_alloc&) {
+        return E_OUTOFMEMORY;
+    } catch (const exception& e) {
+        debug("tar_item_stream::Clone: {}\n", e.what());
+        return E_FAIL;
+    }
+}
+
+tar_item_stream::tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item& item) : tar(tar), item(item), type(tar->type) {
+    open();
+}
+
+// We don't open anything until we know whether the session can give us what we want.
+
+tar_item_stream::tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item& item, const shared_ptr<extract_session>& session) :
+    tar(tar), item(item), type(tar->type), session(session) {
+}
+
+// Unless it's been turned off, keep decompressing in the background while the
+// caller is dealing with what we've given it.
+
+// Each stream that reads ahead holds on to a few megabytes, so it's off
+// unless asked for, and not worth it for anything smaller than one block.
+
+static unique_ptr<decoder> read_ahead(unique_ptr<decoder> dec, uint64_t size, uint64_t end = UINT64_MAX) {
+    if (!get_setting(u"ReadAhead", 0) || size < READAHEAD_BLOCK_SIZE)
+        return dec;
+
+    return make_unique<readahead_decoder>(move(dec), end);
 }
 
-tar_item_stream::tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item& item) : item(item), type(tar->type) {
+void tar_item_stream::open() {
+    // If the file is stored contiguously, we can decompress it ourselves
+    // rather than getting libarchive to find it for us. For tar.gz, the access
+    // points mean we don't have to start from the beginning.
+
+    // While the archive is still being scanned, the scan thread is adding to
+    // tar->index, and data offsets haven't been checked yet.
+
+    bool scanned = tar->scan_finished();
+    auto& index = scanned ? tar->index : own_index;
+    bool index_complete = scanned && tar->index_complete;
+
+    if (scanned && item.data_offset != -1 && tar->type & archive_type::tarball) {
+        dec = open_decoder(tar->archive_fn, tar->type, index, 0, index_complete);
+        dec->seek(item.data_offset);
+        dec = read_ahead(move(dec), item.size, item.data_offset + item.size);
+        return;
+    }
+
+    if (tar->type == archive_type::gzip) {
+        dec = read_ahead(make_unique<gzip_decoder>(tar->archive_fn, index), item.size);
+        return;
+    } else if (tar->type == archive_type::bz2) {
+        dec = read_ahead(make_unique<bz2_decoder>(tar->archive_fn, index, index_complete), item.size);
+        return;
+    } else if (tar->type == archive_type::xz) {
+        dec = read_ahead(make_unique<xz_decoder>(tar->archive_fn), item.size);
+        return;
+    }
+
     if (tar->type & archive_type::tarball) {
         struct archive_entry* entry;
 
@@ -376,66 +577,265 @@ tar_item_stream::tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item&
         return;
     }
 
-    switch (tar->type) {
-        case archive_type::gzip: {
-            gzf = gzopen_w((wchar_t*)tar->archive_fn.u16string().c_str(), "r");
+    throw runtime_error("FIXME - unsupported archive type"); // FIXME
+}
+
+#define SPILL_MEMORY_ENTRY 1048576 // largest entry we'll keep in memory
+#define SPILL_MEMORY_LIMIT 67108864 // total we'll keep in memory
+
+static void write_at(HANDLE h, uint64_t off, const void* buf, DWORD len) {
+    OVERLAPPED ol;
+    DWORD written;
+
+    memset(&ol, 0, sizeof(ol));
+    ol.Offset = (DWORD)off;
+    ol.OffsetHigh = (DWORD)(off >> 32);
+
+    if (!WriteFile(h, buf, len, &written, &ol))
+        throw last_error("WriteFile", GetLastError());
+}
+
+extract_session::extract_session(const shared_ptr<tar_info>& tar, const vector<tar_item*>& items) : tar(tar) {
+    for (auto item : items) {
+        if (!item->dir && item->header_offset != -1)
+            entries[item->header_offset].size = item->size;
+    }
+
+    dec = open_decoder(tar->archive_fn, tar->type, index);
+
+    a = archive_read_new();
+
+    try {
+        archive_read_support_format_all(a);
+
+        if (tar->type == archive_type::tarball)
+            archive_read_support_filter_all(a);
+
+        dec->open_archive(a);
+    } catch (...) {
+        archive_read_free(a);
+        throw;
+    }
+}
+
+extract_session::~extract_session() {
+    archive_read_free(a);
+
+    debug("extract_session: decoded {} bytes to deliver {} ({:.2f}x)\n", bytes_decoded, bytes_delivered,
+          bytes_delivered == 0 ? 0.0 : ((double)bytes_decoded / (double)bytes_delivered));
+}
+
+size_t extract_session::read_archive(uint8_t* buf, size_t len) {
+    auto r = archive_read_data(a, buf, len);
+
+    if (r < 0)
+        throw runtime_error(archive_error_string(a));
+
+    tar->extract_decoded += dec->position - bytes_decoded;
+    bytes_decoded = dec->position;
+
+    return (size_t)r;
+}
+
+// Puts aside the rest of the current entry, so that we can move on.
+
+void extract_session::spill_current() {
+    auto& ent = *current;
+    string buf;
+
+    current = nullptr;
+
+    ent.state = extract_state::spilled;
+    ent.spill_start = ent.consumed;
+
+    auto left = ent.size > ent.consumed ? ent.size - ent.consumed : 0;
+
+    if (left == 0)
+        return;
+
+    bool to_memory = left <= SPILL_MEMORY_ENTRY && spill_memory + left <= SPILL_MEMORY_LIMIT;
+
+    if (!to_memory && !spill_file) {
+        WCHAR temp_path[MAX_PATH];
+
+        if (GetTempPathW(sizeof(temp_path) / sizeof(WCHAR), temp_path) == 0)
+            throw last_error("GetTempPath", GetLastError());
+
+        auto fn = get_temp_file_name(temp_path, u"tar", 0);
+
+        spill_file.reset(CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                                     CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr));
+
+        if (spill_file.get() == INVALID_HANDLE_VALUE) {
+            spill_file.release();
+            throw last_error("CreateFile", GetLastError());
+        }
+    }
+
+    if (!to_memory)
+        ent.spill_offset = spill_file_size;
+
+    buf.resize(BLOCK_SIZE);
 
-            if (!gzf)
-                throw formatted_error("Could not open gzip file {}.", tar->archive_fn.string());
+    do {
+        auto read = read_archive((uint8_t*)buf.data(), buf.size());
 
+        if (read == 0)
             break;
+
+        if (to_memory)
+            ent.spill_data.append(buf.data(), read);
+        else {
+            write_at(spill_file.get(), spill_file_size, buf.data(), (DWORD)read);
+            spill_file_size += read;
         }
 
-        case archive_type::bz2: {
-            h.reset(CreateFileW((LPCWSTR)tar->archive_fn.u16string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
-                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+        ent.spill_length += read;
+    } while (true);
+
+    if (to_memory)
+        spill_memory += ent.spill_length;
+}
+
+// Frees anything we've put aside for an entry, which won't be asked for again.
+// Space in the temporary file isn't reused, but memory is.
+
+void extract_session::drop(extract_entry& ent) {
+    if (&ent == current)
+        current = nullptr;
+
+    if (ent.state == extract_state::spilled && !ent.spill_offset.has_value()) {
+        spill_memory -= ent.spill_data.size();
+        ent.spill_data = string();
+    }
 
-            if (h.get() == INVALID_HANDLE_VALUE)
-                throw last_error("CreateFile", GetLastError());
+    ent.state = extract_state::gone;
+}
 
-            bz2_strm.bzalloc = nullptr;
-            bz2_strm.bzfree = nullptr;
-            bz2_strm.opaque = nullptr;
+// Moves through the archive until we get to item, putting aside anything else
+// we're going to want. Returns false if we've already gone past it.
 
-            auto ret = BZ2_bzDecompressInit(&bz2_strm, 0, 0);
-            if (ret != BZ_OK)
-                throw formatted_error("BZ2_bzDecompressInit returned {}.", ret);
+bool extract_session::advance_to(const tar_item& item) {
+    struct archive_entry* entry;
 
-            inbuf.resize(4096);
-            outbuf.resize(4096);
+    if (current)
+        spill_current();
 
-            bz2_strm.next_in = nullptr;
-            bz2_strm.avail_in = 0;
-            bz2_strm.next_out = outbuf.data();
-            bz2_strm.avail_out = outbuf.length();
+    while (!archive_done) {
+        auto r = archive_read_next_header(a, &entry);
 
+        if (r == ARCHIVE_EOF) {
+            archive_done = true;
             break;
+        } else if (r != ARCHIVE_OK && r != ARCHIVE_WARN) // the scan lets warnings through too
+            throw runtime_error(archive_error_string(a));
+
+        auto off = archive_read_header_position(a);
+        auto it = entries.find(off);
+
+        if (it == entries.end() || it->second.state != extract_state::pending)
+            continue;
+
+        current = &it->second;
+        current->state = extract_state::current;
+
+        if (off == item.header_offset)
+            return true;
+
+        spill_current();
+    }
+
+    return false;
+}
+
+size_t extract_session::read_spill(extract_entry& ent, uint64_t offset, uint8_t* buf, size_t len) {
+    auto end = ent.spill_start + ent.spill_length;
+
+    if (offset >= end)
+        return 0;
+
+    len = (size_t)min((uint64_t)len, end - offset);
+
+    if (ent.spill_offset.has_value())
+        return read_at(spill_file.get(), ent.spill_offset.value() + offset - ent.spill_start, buf, (DWORD)len);
+
+    memcpy(buf, ent.spill_data.data() + offset - ent.spill_start, len);
+
+    return len;
+}
+
+// Returns nullopt if we can't provide this part of the file, in which case the
+// stream will have to find it itself.
+
+optional<size_t> extract_session::read(const tar_item& item, uint64_t offset, uint8_t* buf, size_t len) {
+    lock_guard lg(mutex);
+
+    auto it = entries.find(item.header_offset);
+
+    if (it == entries.end())
+        return nullopt;
+
+    auto& ent = it->second;
+
+    if (ent.state == extract_state::pending && !advance_to(item)) {
+        ent.state = extract_state::gone;
+        return nullopt;
+    }
+
+    switch (ent.state) {
+        case extract_state::spilled: {
+            if (offset < ent.spill_start)
+                return nullopt;
+
+            auto read = read_spill(ent, offset, buf, len);
+
+            bytes_delivered += read;
+            tar->extract_delivered += read;
+
+            // If the stream wants it again, it can find it itself.
+            if (offset + read >= ent.spill_start + ent.spill_length)
+                drop(ent);
+
+            return read;
         }
 
-        case archive_type::xz: {
-            h.reset(CreateFileW((LPCWSTR)tar->archive_fn.u16string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
-                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+        case extract_state::current: {
+            if (offset < ent.consumed)
+                return nullopt;
 
-            if (h.get() == INVALID_HANDLE_VALUE)
-                throw last_error("CreateFile", GetLastError());
+            // skip anything the stream doesn't want
 
-            auto ret = lzma_stream_decoder(&xz_strm, UINT64_MAX, 0);
+            while (ent.consumed < offset) {
+                auto read = read_archive(buf, (size_t)min((uint64_t)len, offset - ent.consumed));
 
-            if (ret != LZMA_OK)
-                throw formatted_error("lzma_stream_decoder returned {}.", ret);
+                if (read == 0)
+                    return 0;
 
-            inbuf.resize(4096);
-            outbuf.resize(4096);
+                ent.consumed += read;
+            }
 
-            xz_strm.next_in = nullptr;
-            xz_strm.avail_in = 0;
-            xz_strm.next_out = (uint8_t*)outbuf.data();
-            xz_strm.avail_out = outbuf.length();
+            auto read = read_archive(buf, len);
 
-            break;
+            ent.consumed += read;
+            bytes_delivered += read;
+            tar->extract_delivered += read;
+
+            return read;
         }
 
         default:
-            throw runtime_error("FIXME - unsupported archive type"); // FIXME
+            return nullopt;
     }
 }
+
+// Called when a stream goes away, so that we don't hold on to or put aside
+// anything for it. If it had a clone, that will have to find the file itself.
+
+void extract_session::release(const tar_item& item) {
+    lock_guard lg(mutex);
+
+    auto it = entries.find(item.header_offset);
+
+    if (it != entries.end())
+        drop(it->second);
+}
@@ -17,6 +17,8 @@
 
 #include "tarfldr.h"
 #include "resource.h"
+#include <algorithm>
+#include <wctype.h>
 
 using namespace std;
 
@@ -29,17 +31,63 @@ static const array prog_ids = { // name, description, icon number
     make_tuple(u"TarFolderCompressed", IDS_TAR_COMP_DESC, 1)
 };
 
-#define BLOCK_SIZE 20480
+#define TAR_BLOCK_SIZE 512
+#define PROGRESS_INTERVAL 50 // ms
+#define DEFAULT_ACCESS_POINT_SPACING 4 // MB
+#define DEFAULT_CATALOG_SIZE 256 // MB
+#define SIZE_BUFFER 1048576
 
 LONG objs_loaded = 0;
 HINSTANCE instance = nullptr;
 
-void tar_info::add_entry(const string_view& fn, int64_t size, const optional<time_t>& mtime, bool is_dir,
-                         const char* user, const char* group, mode_t mode) {
+#define STRING_ARENA_CHUNK_SIZE 65536
+
+string_view string_arena::add(const string_view& s) {
+    if (s.empty())
+        return "";
+
+    if (s.length() > left) {
+        // big strings get a chunk of their own, so we don't waste the rest of the current one
+
+        if (s.length() > STRING_ARENA_CHUNK_SIZE / 4) {
+            auto& chunk = chunks.emplace_back(new char[s.length()]);
+
+            memcpy(chunk.get(), s.data(), s.length());
+            allocated += s.length();
+
+            return string_view(chunk.get(), s.length());
+        }
+
+        next = chunks.emplace_back(new char[STRING_ARENA_CHUNK_SIZE]).get();
+        left = STRING_ARENA_CHUNK_SIZE;
+        allocated += STRING_ARENA_CHUNK_SIZE;
+    }
+
+    memcpy(next, s.data(), s.length());
+
+    string_view ret(next, s.length());
+
+    next += s.length();
+    left -= s.length();
+
+    return ret;
+}
+
+size_t string_arena::memory_usage() const {
+    return allocated + (chunks.capacity() * sizeof(unique_ptr<char[]>));
+}
+
+tar_item* tar_info::add_entry(const string_view& fn2, int64_t size, const optional<time_t>& mtime, bool is_dir,
+                              const string_view& user, const string_view& group, mode_t mode,
+                              int64_t header_offset, int64_t data_offset) {
     vector<string_view> parts;
     string_view file_part;
     tar_item* r;
 
+    // all our names are substrings of this
+
+    auto fn = strings.add(fn2);
+
     // split by slashes
 
     {
@@ -71,38 +119,52 @@ void tar_info::add_entry(const string_view& fn, int64_t size, const optional<tim
     }
 
     if (parts.empty())
-        return;
+        return nullptr;
 
     file_part = parts.back();
     parts.pop_back();
 
     r = &root;
 
+    auto add_to_totals = [](tar_item* dir, const tar_item& item) {
+        for (; dir; dir = dir->parent) {
+            if (item.dir)
+                dir->totals.dirs++;
+            else {
+                dir->totals.files++;
+                dir->totals.size += item.size;
+            }
+        }
+    };
+
     // add dirs
 
     for (const auto& p : parts) {
-        bool found = false;
+        auto c = r->get_child(p);
 
-        for (auto& c : r->children) {
-            if (c.name == p) {
-                found = true;
-                r = &c;
-                break;
-            }
+        if (!c) {
+            c = &items.emplace_back(p, 0, true, "", nullopt, root.user, root.group, 0, r, -1, -1);
+            c->index = (uint32_t)(items.size() - 1);
+            r->add_child(c);
+            add_to_totals(r, *c);
         }
 
-        if (!found) {
-            r->children.emplace_back(p, size, true, "", nullopt, "", "", 0, r);
-            r = &r->children.back();
-        }
+        r = c;
     }
 
     // add child
 
-    if (!file_part.empty()) {
-        r->children.emplace_back(file_part, size, is_dir, fn, mtime, user ? user : "",
-                                 group ? group : "", mode, r);
-    }
+    if (file_part.empty())
+        return nullptr;
+
+    auto& item = items.emplace_back(file_part, size, is_dir, fn, mtime, get_owner(user), get_owner(group),
+                                    mode, r, header_offset, data_offset);
+
+    item.index = (uint32_t)(items.size() - 1);
+    r->add_child(&item);
+    add_to_totals(r, item);
+
+    return &item;
 }
 
 enum archive_type identify_file_type(const u16string_view& fn2) {
@@ -155,33 +217,502 @@ enum archive_type identify_file_type(const u16string_view& fn2) {
     return type;
 }
 
-tar_info::tar_info(const filesystem::path& fn) : archive_fn(fn), root("", 0, true, "", nullopt, "", "", 0, nullptr) {
-    auto fn2 = fn.filename().u16string();
-    bool is_tarball = true;
+static filesystem::path get_catalog_dir() {
+    HRESULT hr;
+    WCHAR* appdata;
+
+    hr = SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &appdata);
+    if (FAILED(hr))
+        throw formatted_error("SHGetKnownFolderPath returned {:08x}.", (uint32_t)hr);
+
+    filesystem::path dir = (char16_t*)appdata;
+
+    CoTaskMemFree(appdata);
+
+    return dir / u"tarfldr" / u"catalog";
+}
+
+catalog_key tar_info::get_catalog_key() const {
+    catalog_key key;
+    LARGE_INTEGER size;
+    FILETIME creation_time, access_time, write_time;
+
+    unique_handle h{CreateFileW((LPCWSTR)archive_fn.u16string().c_str(), READ_ATTRIBUTES, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
+
+    if (h.get() == INVALID_HANDLE_VALUE)
+        throw last_error("CreateFile", GetLastError());
+
+    if (!GetFileSizeEx(h.get(), &size))
+        throw last_error("GetFileSizeEx", GetLastError());
+
+    if (!GetFileTime(h.get(), &creation_time, &access_time, &write_time))
+        throw last_error("GetFileTime", GetLastError());
+
+    key.path = utf16_to_utf8(archive_fn.u16string());
+    key.size = size.QuadPart;
+    key.mtime = ((int64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime;
+    key.type = (uint32_t)type;
+
+    return key;
+}
+
+void tar_info::save_catalog(const filesystem::path& fn, const catalog_key& key) const {
+    catalog_writer cw(key);
+
+    // Synthesized directories have no full_path, and will get recreated by
+    // add_entry when the catalog is loaded.
+
+    // items are in the order they were added, i.e. archive order
+
+    for (const auto& c : items) {
+        if (!c.full_path.empty())
+            cw.add({ c.full_path, c.user->name, c.group->name, c.size, c.mtime, c.dir, (uint32_t)c.mode, c.header_offset, c.data_offset });
+    }
+
+    for (const auto& ap : index) {
+        cw.add_access_point({ ap.in_offset, ap.out_offset, ap.bits, ap.window });
+    }
+
+    filesystem::create_directories(fn.parent_path());
+
+    cw.save(fn);
+
+    prune_catalogs(fn.parent_path(), fn, (uint64_t)get_setting(u"CatalogSize", DEFAULT_CATALOG_SIZE) << 20);
+}
+
+const tar_owner* tar_info::get_owner(const string_view& name) {
+    if (auto it = owner_map.find(name); it != owner_map.end())
+        return it->second;
+
+    auto& o = owners.emplace_back(strings.add(name), TAR_OWNER_UNRANKED);
+
+    owner_map.emplace(o.name, &o);
+
+    return &o;
+}
+
+// Called once we've got all the entries. Until then, anything sorting by owner
+// compares the names instead.
+
+void tar_info::rank_owners() {
+    vector<tar_owner*> sorted;
+
+    if (ranked_owners == owners.size())
+        return;
+
+    sorted.reserve(owners.size());
+
+    for (auto& o : owners) {
+        sorted.push_back(&o);
+    }
+
+    sort(sorted.begin(), sorted.end(), [](const tar_owner* a, const tar_owner* b) {
+        return a->name < b->name;
+    });
+
+    for (uint32_t i = 0; i < sorted.size(); i++) {
+        sorted[i]->rank = i;
+    }
+
+    ranked_owners = owners.size();
+
+    // sort orders worked out before this may have been by name
+    sort_ranks.clear();
+}
+
+// Throws away anything we got from a catalog that turned out to be bad, so
+// that we can start again from the archive itself.
+
+void tar_info::reset() {
+    items.erase(items.begin() + 1, items.end());
+    root.children.clear();
+    root.child_index.reset();
+    root.totals = {};
+    index.clear();
+    sort_ranks.clear();
+    owner_map.clear();
+    owners.clear();
+    ranked_owners = 0;
+    strings = string_arena{};
+
+    root.user = root.group = get_owner("");
+}
+
+// PIDLs can outlive us, or even the process, so this isn't guaranteed to be
+// unique - get_child checks the name as well.
+
+static atomic<uint32_t> next_generation = (uint32_t)GetCurrentProcessId() << 16;
+
+tar_info::tar_info(const filesystem::path& fn) : root(items.emplace_back("", 0, true, "", nullopt, nullptr, nullptr, 0, nullptr, -1, -1)), archive_fn(fn) {
+    optional<catalog_key> key;
+    filesystem::path catalog_fn;
+
+    generation = next_generation++;
+
+    root.user = root.group = get_owner("");
+
+    type = identify_file_type(fn.filename().u16string());
+
+    if (type != archive_type::unknown)
+        type = detect_compression(fn, type);
+
+    try {
+        key = get_catalog_key();
+        catalog_fn = get_catalog_dir() / catalog_filename(key.value());
+
+        auto loaded = load_catalog(catalog_fn, key.value(), [&](const catalog_entry& ent) {
+            add_entry(ent.path, ent.size, ent.mtime, ent.dir, ent.user, ent.group, (mode_t)ent.mode,
+                      ent.header_offset, ent.data_offset);
+        }, [&](const catalog_access_point& ap) {
+            index.emplace_back(access_point{ ap.in_offset, ap.out_offset, ap.bits, string{ap.window} });
+        });
+
+        if (loaded) {
+            error_code ec;
+
+            debug("Loaded {} from catalog {}.\n", fn.string(), catalog_fn.string());
+
+            // so that prune_catalogs knows it's still wanted
+            filesystem::last_write_time(catalog_fn, filesystem::file_time_type::clock::now(), ec);
+
+            rank_owners();
+            index_complete = true;
+            finished = true;
+            return;
+        }
+    } catch (const exception& e) {
+        debug("Could not load catalog for {}: {}\n", fn.string(), e.what());
+
+        reset();
+    }
+
+    // No catalog, so we'll have to read the archive itself. This can take
+    // minutes for a big compressed file, so do it in the background and let
+    // people see the entries as we go.
+
+    scanner = thread([this, key, catalog_fn]() {
+        scan_thread(key, catalog_fn);
+    });
+}
+
+tar_info::~tar_info() {
+    if (scanner.joinable()) {
+        cancelled = true;
+        scanner.join();
+    }
+}
+
+void tar_info::scan_thread(const optional<catalog_key>& key, const filesystem::path& catalog_fn) {
+    try {
+        scan();
+    } catch (const exception& e) {
+        debug("Error scanning {}: {}\n", archive_fn.string(), e.what());
+
+        error = current_exception();
+    }
+
+    {
+        lock_guard lg(mutex);
+
+        rank_owners();
+        index_complete = !error;
+        finished = true;
+    }
+
+    cv.notify_all();
+
+    // Nothing changes the tree now, so we can read it without the lock. We
+    // don't want to save a partial list if the scan failed.
+
+    if (!key.has_value() || error)
+        return;
+
+    try {
+        save_catalog(catalog_fn, key.value());
+    } catch (const exception& e) {
+        debug("Could not save catalog for {}: {}\n", archive_fn.string(), e.what());
+    }
+}
+
+// Called by the scan thread after each entry. Waking up everybody for every
+// single entry would be wasteful, so we only do it every so often.
+
+void tar_info::notify_progress() {
+    entries_found++;
+
+    set_priority();
+
+    auto now = GetTickCount64();
+
+    if (now - last_notify < PROGRESS_INTERVAL)
+        return;
+
+    last_notify = now;
+
+    cv.notify_all();
+}
+
+// Somebody waiting on the scan means that the user is, too, so the scan
+// thread runs at normal priority. Otherwise it goes into background mode, so
+// it doesn't get in the way of anything the user is waiting for.
+
+void tar_info::wait_until(unique_lock<std::mutex>& ul, const function<bool()>& pred) {
+    waiters++;
+    cv.wait(ul, pred);
+    waiters--;
+}
+
+void tar_info::set_priority() {
+    bool want_background = waiters == 0;
+
+    if (want_background == background)
+        return;
+
+    SetThreadPriority(GetCurrentThread(), want_background ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END);
+    background = want_background;
+}
+
+void tar_info::cancel() {
+    cancelled = true;
+}
+
+tar_item* tar_info::get_child(const tar_item& dir, const string_view& name) {
+    unique_lock ul(mutex);
+
+    auto c = dir.get_child(name);
+
+    if (c || finished)
+        return c;
+
+    // we might not have got to it yet
+
+    wait_until(ul, [&]() { return finished; });
+
+    return dir.get_child(name);
+}
+
+tar_item* tar_info::get_child(const tar_item& dir, const SHITEMID& id) {
+    tar_pidl_header h;
+
+    if (id.cb < offsetof(SHITEMID, abID))
+        return nullptr;
+
+    // Older versions just put the name in the PIDL, and Explorer keeps these
+    // around in shortcuts and the like.
+
+    if (id.cb < offsetof(SHITEMID, abID) + sizeof(tar_pidl_header))
+        return get_child(dir, string_view{(char*)id.abID, id.cb - offsetof(SHITEMID, abID)});
+
+    memcpy(&h, id.abID, sizeof(h));
+
+    if (h.magic != TAR_PIDL_MAGIC)
+        return get_child(dir, string_view{(char*)id.abID, id.cb - offsetof(SHITEMID, abID)});
+
+    // if the generation or index is stale, we fall back to looking up the name
+
+    string_view name{(char*)id.abID + sizeof(h), id.cb - offsetof(SHITEMID, abID) - sizeof(h)};
+
+    {
+        lock_guard lg(mutex);
+
+        if (h.generation == generation && h.index < items.size()) {
+            auto& item = items[h.index];
+
+            if (item.parent == &dir && item.name == name)
+                return &item;
+        }
+    }
+
+    return get_child(dir, name);
+}
+
+tar_item* tar_info::find_child(tar_item& dir, const u16string_view& name) {
+    unique_lock ul(mutex);
+    tar_item* c;
+
+    dir.find_child(name, &c);
+
+    if (c || finished)
+        return c;
+
+    wait_until(ul, [&]() { return finished; });
+
+    dir.find_child(name, &c);
+
+    return c;
+}
+
+// Returns child number num of dir, waiting for it to be found if need be, or
+// nullptr if there aren't that many.
+
+tar_item* tar_info::wait_for_child(const tar_item& dir, size_t num, bool wait) {
+    unique_lock ul(mutex);
+
+    if (wait)
+        wait_until(ul, [&]() { return num < dir.children.size() || finished; });
+
+    return num < dir.children.size() ? dir.children[num] : nullptr;
+}
+
+tar_dir_totals tar_info::get_totals(const tar_item& dir) const {
+    lock_guard lg(mutex);
+
+    return dir.totals;
+}
 
-    type = identify_file_type(fn2);
+// Explorer sorts a folder by calling CompareIDs over and over, so the first
+// time a directory gets sorted by a column we work out where each child goes,
+// and after that it's just a matter of comparing two numbers. func is given a
+// copy of the children, and returns their ranks in the same order. While the
+// scan is running the directory keeps growing, so we return nullptr and the
+// caller compares the items themselves. The cache is also cleared when the
+// owners get ranked.
+
+shared_ptr<const vector<uint32_t>> tar_info::get_sort_ranks(const tar_item& dir, unsigned int col,
+                                                           const function<vector<uint32_t>(const vector<tar_item*>&)>& func) {
+    vector<tar_item*> children;
+    size_t owners_ranked;
+
+    {
+        lock_guard lg(mutex);
+
+        if (!finished)
+            return nullptr;
+
+        if (auto it = sort_ranks.find({&dir, col}); it != sort_ranks.end())
+            return it->second;
+
+        children = dir.children;
+        owners_ranked = ranked_owners;
+    }
+
+    auto ranks = make_shared<const vector<uint32_t>>(func(children));
+
+    {
+        lock_guard lg(mutex);
+
+        if (ranked_owners == owners_ranked)
+            sort_ranks[{&dir, col}] = ranks;
+    }
+
+    return ranks;
+}
+
+void tar_info::wait() {
+    unique_lock ul(mutex);
+
+    wait_until(ul, [&]() { return finished; });
+
+    if (error)
+        rethrow_exception(error);
+}
+
+bool tar_info::scan_finished() const {
+    lock_guard lg(mutex);
+
+    return finished;
+}
+
+bool tar_info::scan_failed() const {
+    lock_guard lg(mutex);
+
+    return finished && error;
+}
+
+void tar_info::scan() {
+    auto fn2 = archive_fn.filename().u16string();
 
     if (type & archive_type::tarball) {
         struct archive_entry* entry;
         struct archive* a = archive_read_new();
+        unique_ptr<decoder> dec;
 
         try {
-            archive_read_support_filter_all(a);
             archive_read_support_format_all(a);
 
-            auto r = archive_read_open_filename_w(a, (wchar_t*)fn.u16string().c_str(), BLOCK_SIZE);
+            // We do the decompression ourselves, so that we can record access
+            // points as we go - xz files come with their own index. For
+            // uncompressed files, libarchive can skip over the file data rather
+            // than reading it.
+
+            dec = open_decoder(archive_fn, type, index, (uint64_t)get_setting(u"AccessPointSpacing", DEFAULT_ACCESS_POINT_SPACING) << 20,
+                               false, &cancelled);
+
+            // in case it's compressed despite its name
+            if (type == archive_type::tarball)
+                archive_read_support_filter_all(a);
+
+            dec->index_mutex = &mutex;
+            dec->open_archive(a);
+
+            // Offsets are within the uncompressed stream. We only record a data
+            // offset for a file if it turns out to have been stored contiguously,
+            // i.e. the next header comes straight after it - this rules out
+            // sparse files, whose map may not be known until the data is read.
+
+            tar_item* pending = nullptr;
+            int r;
 
-            if (r != ARCHIVE_OK)
-                throw runtime_error(archive_error_string(a));
+            auto data_end = [](const tar_item& item) {
+                return item.data_offset + ((item.size + TAR_BLOCK_SIZE - 1) & ~(int64_t)(TAR_BLOCK_SIZE - 1));
+            };
+
+            // ARCHIVE_WARN is for things like unknown pax keywords, or names
+            // that couldn't be converted - the entry itself is fine.
+
+            while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN) {
+                auto header_offset = archive_read_header_position(a);
+
+                bytes_scanned = dec->position;
+
+                if (pending && header_offset != data_end(*pending))
+                    pending->data_offset = -1;
+
+                pending = nullptr;
 
-            while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
                 if (archive_entry_pathname_utf8(entry)) {
-                    add_entry(archive_entry_pathname_utf8(entry), archive_entry_size(entry),
-                            archive_entry_mtime_is_set(entry) ? optional<time_t>{archive_entry_mtime(entry)} : optional<time_t>{nullopt},
-                            archive_entry_filetype(entry) == AE_IFDIR, archive_entry_uname_utf8(entry),
-                            archive_entry_gname_utf8(entry), archive_entry_mode(entry));
+                    auto user = archive_entry_uname_utf8(entry);
+                    auto group = archive_entry_gname_utf8(entry);
+                    int64_t data_offset = -1;
+
+                    if ((archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR &&
+                        archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE &&
+                        archive_entry_filetype(entry) == AE_IFREG && !archive_entry_hardlink(entry) &&
+                        archive_entry_sparse_count(entry) == 0) {
+                        data_offset = archive_filter_bytes(a, 0);
+                    }
+
+                    tar_item* item;
+
+                    {
+                        lock_guard lg(mutex);
+
+                        item = add_entry(archive_entry_pathname_utf8(entry), archive_entry_size(entry),
+                                         archive_entry_mtime_is_set(entry) ? optional<time_t>{archive_entry_mtime(entry)} : optional<time_t>{nullopt},
+                                         archive_entry_filetype(entry) == AE_IFDIR, user ? user : "",
+                                         group ? group : "", archive_entry_mode(entry), header_offset, data_offset);
+                    }
+
+                    notify_progress();
+
+                    if (item && item->data_offset != -1)
+                        pending = item;
                 }
             }
+
+            // a cancelled read looks like an error to the loop above
+
+            dec->check_cancelled();
+
+            // ARCHIVE_FAILED or ARCHIVE_FATAL mean we've only got some of the
+            // entries, which we keep but don't save to the catalog
+
+            if (r != ARCHIVE_EOF)
+                throw runtime_error(archive_error_string(a) ? archive_error_string(a) : "Error reading archive.");
+
+            if (pending && archive_filter_bytes(a, 0) < data_end(*pending))
+                pending->data_offset = -1;
         } catch (...) {
             archive_read_free(a);
             throw;
@@ -191,13 +722,13 @@ tar_info::tar_info(const filesystem::path& fn) : archive_fn(fn), root("", 0, tru
     } else if (type & archive_type::gzip || type & archive_type::bz2 || type & archive_type::xz) {
         auto st = fn2.rfind(u".");
         auto orig_fn = fn2.substr(0, st);
-        size_t size = 0;
+        uint64_t size = 0;
         optional<time_t> mtime;
 
         {
             FILETIME creation_time, access_time, write_time;
             uint64_t file_time;
-            unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, 0, nullptr,
+            unique_handle h{CreateFileW((LPCWSTR)archive_fn.u16string().c_str(), GENERIC_READ, 0, nullptr,
                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
 
             if (h.get() == INVALID_HANDLE_VALUE)
@@ -213,144 +744,95 @@ tar_info::tar_info(const filesystem::path& fn) : archive_fn(fn), root("", 0, tru
             mtime = file_time - 11644473600;
         }
 
-        if (type & archive_type::gzip) {
-            LARGE_INTEGER li;
-            uint32_t size2;
-            DWORD read;
+        // Decompresses the whole file to find out how big it is, adding to the
+        // index as we go so that seeking later on is quick.
 
-            // Read uncompressed length from end of file
+        auto decode_all = [&](decoder& dec) {
+            string buf;
 
-            // FIXME - this isn't reliable: see https://stackoverflow.com/questions/9209138/uncompressed-file-size-using-zlibs-gzip-file-access-function
+            dec.cancelled = &cancelled;
+            dec.index_mutex = &mutex;
+            buf.resize(SIZE_BUFFER);
 
-            unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, 0, nullptr,
-                                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
+            while (dec.read((uint8_t*)buf.data(), buf.size()) > 0) {
+                dec.check_cancelled();
+                set_priority();
+                bytes_scanned = dec.position;
+            }
 
-            if (h.get() == INVALID_HANDLE_VALUE)
-                throw last_error("CreateFile", GetLastError());
+            dec.check_cancelled();
 
-            li.QuadPart = -((int64_t)sizeof(uint32_t));
+            size = dec.position;
+        };
 
-            if (!SetFilePointerEx(h.get(), li, nullptr, FILE_END))
-                throw last_error("SetFilePointerEx", GetLastError());
+        if (type & archive_type::gzip) {
+            // The trailer only has the length of the last member, mod 4 GB, so
+            // it's wrong for big files and for ones made by pigz or by
+            // concatenation.
 
-            if (!ReadFile(h.get(), &size2, sizeof(uint32_t), &read, nullptr))
-                throw last_error("ReadFile", GetLastError());
+            gzip_decoder dec(archive_fn, index, (uint64_t)get_setting(u"AccessPointSpacing", DEFAULT_ACCESS_POINT_SPACING) << 20);
 
-            size = size2;
+            decode_all(dec);
         } else if (type & archive_type::bz2) {
-            int ret;
-            bz_stream strm;
-            char inbuf[4096], outbuf[4096];
-            bool eof = false;
-
-            unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, 0, nullptr,
-                                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
-
-            if (h.get() == INVALID_HANDLE_VALUE)
-                throw last_error("CreateFile", GetLastError());
-
-            strm.bzalloc = nullptr;
-            strm.bzfree = nullptr;
-            strm.opaque = nullptr;
-
-            ret = BZ2_bzDecompressInit(&strm, 0, 0);
-            if (ret != BZ_OK)
-                throw formatted_error("BZ2_bzDecompressInit returned {}.", ret);
-
-            strm.next_in = nullptr;
-            strm.avail_in = 0;
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
-
-            do {
-                if (strm.avail_in == 0 && !eof) {
-                    DWORD read;
+            // the decoder decompresses several blocks at once, so this is
+            // quicker than it looks
+            bz2_decoder dec(archive_fn, index, false, &cancelled);
 
-                    strm.next_in = inbuf;
-
-                    if (!ReadFile(h.get(), inbuf, sizeof(inbuf), &read, nullptr))
-                        throw last_error("ReadFile", GetLastError());
-
-                    strm.avail_in = read;
-
-                    if (read == 0) // end of file
-                        eof = true;
-                }
-
-                ret = BZ2_bzDecompress(&strm);
-
-                if (ret != BZ_OK && ret != BZ_STREAM_END)
-                    throw formatted_error("BZ2_bzDecompress returned {}.", ret);
-
-                if (strm.avail_out == 0 || ret == BZ_STREAM_END)
-                    size += sizeof(outbuf) - strm.avail_out;
-
-                if (strm.avail_out == 0) {
-                    strm.next_out = outbuf;
-                    strm.avail_out = sizeof(outbuf);
-                }
-            } while (ret != BZ_STREAM_END);
+            decode_all(dec);
         } else if (type & archive_type::xz) {
-            uint8_t inbuf[4096], outbuf[4096];
-            bool eof = false;
-
-            lzma_stream strm = LZMA_STREAM_INIT;
+            // xz files have an index at the end, so we don't need to decompress anything
 
-            unique_handle h{CreateFileW((LPCWSTR)fn.u16string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
-                                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)};
-
-            if (h.get() == INVALID_HANDLE_VALUE)
-                throw last_error("CreateFile", GetLastError());
-
-            auto ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+            size = xz_decoder(archive_fn).size().value();
+        }
 
-            try {
-                if (ret != LZMA_OK)
-                    throw formatted_error("lzma_stream_decoder returned {}.", ret);
+        {
+            lock_guard lg(mutex);
 
-                strm.next_in = nullptr;
-                strm.avail_in = 0;
-                strm.next_out = outbuf;
-                strm.avail_out = sizeof(outbuf);
+            add_entry(utf16_to_utf8(orig_fn), size, mtime, false, "", "", 0, -1, -1);
+        }
 
-                do {
-                    if (strm.avail_in == 0 && !eof) {
-                        DWORD read;
+        entries_found++;
+    }
+}
 
-                        strm.next_in = inbuf;
+size_t tar_info::memory_usage() const {
+    lock_guard lg(mutex);
+    size_t size = sizeof(tar_info) + strings.memory_usage();
 
-                        if (!ReadFile(h.get(), inbuf, sizeof(inbuf), &read, nullptr))
-                            throw last_error("ReadFile", GetLastError());
+    for (const auto& item : items) {
+        size += sizeof(tar_item) + (item.children.capacity() * sizeof(tar_item*));
 
-                        strm.avail_in = read;
+        // rough guess at unordered_map overhead: a bucket pointer, plus a node for each entry
 
-                        if (read == 0) // end of file
-                            eof = true;
-                    }
+        if (item.child_index) {
+            for (size_t buckets : { item.child_index->names.bucket_count(), item.child_index->folded.bucket_count() }) {
+                size += (buckets * sizeof(void*)) + (item.children.size() * 4 * sizeof(void*));
+            }
+        }
+    }
 
-                    ret = lzma_code(&strm, eof ? LZMA_FINISH : LZMA_RUN);
+    for (const auto& ap : index) {
+        size += sizeof(access_point) + ap.window.capacity();
+    }
 
-                    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
-                        throw formatted_error("lzma_code returned {}.", ret);
+    size += owners.size() * (sizeof(tar_owner) + (6 * sizeof(void*)));
 
-                    if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
-                        size += sizeof(outbuf) - strm.avail_out;
+    for (const auto& sr : sort_ranks) {
+        size += sizeof(sr) + (4 * sizeof(void*)) + (sr.second->capacity() * sizeof(uint32_t));
+    }
 
-                    if (strm.avail_out == 0) {
-                        strm.next_out = outbuf;
-                        strm.avail_out = sizeof(outbuf);
-                    }
-                } while (ret != LZMA_STREAM_END);
-            } catch (...) {
-                lzma_end(&strm);
-                throw;
-            }
+    return size;
+}
 
-            lzma_end(&strm);
-        }
+uint32_t get_setting(const u16string& name, uint32_t def) {
+    DWORD value, size = sizeof(value);
 
-        add_entry(utf16_to_utf8(orig_fn).c_str(), size, mtime, false, nullptr, nullptr, 0);
+    if (RegGetValueW(HKEY_CURRENT_USER, L"Software\\tarfldr", (WCHAR*)name.c_str(), RRF_RT_REG_DWORD, nullptr,
+                     &value, &size) != ERROR_SUCCESS) {
+        return def;
     }
+
+    return value;
 }
 
 extern "C" STDAPI DllCanUnloadNow(void) {
@@ -519,14 +1001,29 @@ extern "C" HRESULT DllUnregisterServer() {
     }
 }
 
-ITEMID_CHILD* tar_item::make_pidl_child() const {
-    auto item = (ITEMIDLIST*)CoTaskMemAlloc(offsetof(ITEMIDLIST, mkid.abID) + name.length() + offsetof(ITEMIDLIST, mkid.abID));
+static size_t pidl_item_size(const tar_item& item) {
+    return offsetof(ITEMIDLIST, mkid.abID) + sizeof(tar_pidl_header) + item.name.length();
+}
+
+static void write_pidl_item(ITEMIDLIST* pidl, const tar_item& item, uint32_t generation) {
+    tar_pidl_header h;
+
+    h.magic = TAR_PIDL_MAGIC;
+    h.generation = generation;
+    h.index = item.index;
+
+    pidl->mkid.cb = (USHORT)pidl_item_size(item);
+    memcpy(pidl->mkid.abID, &h, sizeof(h));
+    memcpy(pidl->mkid.abID + sizeof(h), item.name.data(), item.name.length());
+}
+
+ITEMID_CHILD* tar_item::make_pidl_child(uint32_t generation) const {
+    auto item = (ITEMIDLIST*)CoTaskMemAlloc(pidl_item_size(*this) + offsetof(ITEMIDLIST, mkid.abID));
 
     if (!item)
         throw bad_alloc();
 
-    item->mkid.cb = offsetof(ITEMIDLIST, mkid.abID) + name.length();
-    memcpy(item->mkid.abID, name.data(), name.length());
+    write_pidl_item(item, *this, generation);
 
     auto nextitem = (ITEMIDLIST*)((uint8_t*)item + item->mkid.cb);
     nextitem->mkid.cb = 0;
@@ -534,13 +1031,13 @@ ITEMID_CHILD* tar_item::make_pidl_child() const {
     return item;
 }
 
-ITEMID_CHILD* tar_item::make_relative_pidl(tar_item* root) const {
+ITEMID_CHILD* tar_item::make_relative_pidl(tar_item* root, uint32_t generation) const {
     size_t size = offsetof(ITEMIDLIST, mkid.abID);
 
     const tar_item* p = this;
 
     while (p && p != root) {
-        size += offsetof(ITEMIDLIST, mkid.abID) + p->name.length();
+        size += pidl_item_size(*p);
         p = p->parent;
     }
 
@@ -556,10 +1053,9 @@ ITEMID_CHILD* tar_item::make_relative_pidl(tar_item* root) const {
     p = this;
 
     while (p && p != root) {
-        ptr = (ITEMIDLIST*)((uint8_t*)ptr - offsetof(ITEMIDLIST, mkid.abID) - p->name.length());
+        ptr = (ITEMIDLIST*)((uint8_t*)ptr - pidl_item_size(*p));
 
-        ptr->mkid.cb = offsetof(ITEMIDLIST, mkid.abID) + p->name.length();
-        memcpy(ptr->mkid.abID, p->name.data(), p->name.length());
+        write_pidl_item(ptr, *p, generation);
 
         p = p->parent;
     }
@@ -567,14 +1063,100 @@ ITEMID_CHILD* tar_item::make_relative_pidl(tar_item* root) const {
     return item;
 }
 
+// Names are compared case-insensitively by lowercasing their UTF-16 forms
+// with towlower, which is what _wcsicmp does to each character - so two names
+// match here exactly when _wcsicmp says they're equal. Every item has a hash
+// of its lowercased name, so find_child only has to convert the names of the
+// children whose hashes match.
+
+static u16string fold_name(const u16string_view& name) {
+    u16string ret{name};
+
+    for (auto& c : ret) {
+        c = (char16_t)towlower((wchar_t)c);
+    }
+
+    return ret;
+}
+
+static uint32_t hash_folded_name(const u16string_view& folded) {
+    uint32_t hash = 0x811c9dc5;
+
+    // FNV-1a
+
+    for (auto c : folded) {
+        hash ^= c;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+// The type name Explorer shows only depends on the extension, so we only need
+// to ask the shell once for each one. Directories all get the same name.
+
+static mutex type_names_mutex;
+static unordered_map<u16string, u16string> type_names; // folded extension, or "/" for directories
+
+u16string tar_item::get_type_name() const {
+    SHFILEINFOW sfi;
+    u16string key, name16;
+
+    name16 = utf8_to_utf16(name);
+
+    if (dir)
+        key = u"/";
+    else if (auto st = name16.rfind(u'.'); st != u16string::npos)
+        key = fold_name(u16string_view(name16).substr(st));
+
+    {
+        lock_guard lg(type_names_mutex);
+
+        if (auto it = type_names.find(key); it != type_names.end())
+            return it->second;
+    }
+
+    if (!SHGetFileInfoW((LPCWSTR)name16.c_str(), dir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL,
+                        &sfi, sizeof(sfi), SHGFI_USEFILEATTRIBUTES | SHGFI_TYPENAME)) {
+        throw last_error("SHGetFileInfo", GetLastError());
+    }
+
+    u16string type = (char16_t*)sfi.szTypeName;
+
+    lock_guard lg(type_names_mutex);
+
+    type_names.emplace(key, type);
+
+    return type;
+}
+
 void tar_item::find_child(const std::u16string_view& name, tar_item** ret) {
-    u16string n{name};
+    auto folded = fold_name(name);
+    auto hash = hash_folded_name(folded);
+
+    auto matches = [&](const tar_item* c) {
+        return c->folded_hash == hash && fold_name(utf8_to_utf16(c->name)) == folded;
+    };
+
+    if (child_index) {
+        auto it = child_index->folded.find(hash);
+
+        if (it == child_index->folded.end()) {
+            *ret = nullptr;
+            return;
+        }
+
+        if (matches(it->second)) {
+            *ret = it->second;
+            return;
+        }
 
-    for (auto& c : children) {
-        auto cn = utf8_to_utf16(c.name);
+        // different name with the same hash - fall through to linear search
+    }
 
-        if (!_wcsicmp((wchar_t*)n.c_str(), (wchar_t*)cn.c_str())) {
-            *ret = &c;
+    for (auto c : children) {
+        if (matches(c)) {
+            *ret = c;
             return;
         }
     }
@@ -582,6 +1164,49 @@ void tar_item::find_child(const std::u16string_view& name, tar_item** ret) {
     *ret = nullptr;
 }
 
+// Directories with lots of children get a hash table, so that looking up a name
+// doesn't mean comparing it against every sibling. As with a linear search, if
+// the archive has more than one entry with the same name, the first one wins.
+
+#define CHILD_INDEX_THRESHOLD 32
+
+tar_item* tar_item::get_child(const string_view& name) const {
+    if (child_index) {
+        auto it = child_index->names.find(name);
+
+        return it == child_index->names.end() ? nullptr : it->second;
+    }
+
+    for (auto c : children) {
+        if (c->name == name)
+            return c;
+    }
+
+    return nullptr;
+}
+
+void tar_item::add_child(tar_item* item) {
+    item->folded_hash = hash_folded_name(fold_name(utf8_to_utf16(item->name)));
+    item->child_num = (uint32_t)children.size();
+
+    children.push_back(item);
+
+    if (child_index) {
+        child_index->names.emplace(item->name, item);
+        child_index->folded.emplace(item->folded_hash, item);
+    } else if (children.size() > CHILD_INDEX_THRESHOLD) {
+        child_index.reset(new tar_child_index);
+
+        child_index->names.reserve(children.size() * 2);
+        child_index->folded.reserve(children.size() * 2);
+
+        for (auto c : children) {
+            child_index->names.emplace(c->name, c);
+            child_index->folded.emplace(c->folded_hash, c);
+        }
+    }
+}
+
 SFGAOF tar_item::get_atts() const {
     SFGAOF atts = SFGAO_CANCOPY | SFGAO_HASPROPSHEET;
 
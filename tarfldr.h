@@ -27,6 +27,15 @@
 #include <filesystem>
 #include <optional>
 #include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <span>
 #include <stdint.h>
 #include <shlguid.h>
 #include <fmt/format.h>
@@ -35,6 +44,7 @@
 #include <zlib.h>
 #include <bzlib.h>
 #include <lzma.h>
+#include "catalog.h"
 
 extern const GUID CLSID_TarFolder;
 extern const GUID FMTID_POSIXAttributes;
@@ -88,26 +98,91 @@ public:
 
 typedef std::unique_ptr<HANDLE, handle_closer> unique_handle;
 
+// Strings belonging to a tar_info, allocated in large chunks rather than one
+// at a time. They never move or get freed until the tar_info does.
+
+class string_arena {
+public:
+    std::string_view add(const std::string_view& s);
+    size_t memory_usage() const;
+
+private:
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* next = nullptr;
+    size_t left = 0;
+    size_t allocated = 0;
+};
+
+// A user or group name. Archives usually only have a handful of different
+// owners, so each name is stored once and items point to it.
+
+#define TAR_OWNER_UNRANKED 0xffffffff
+
+struct tar_owner {
+    std::string_view name; // in tar_info's string arena
+    std::atomic<uint32_t> rank; // position of name among all the archive's owners, once the scan has finished
+};
+
+// Totals for everything below a directory, kept up to date as entries get added.
+
+struct tar_dir_totals {
+    uint64_t size = 0;
+    uint32_t files = 0;
+    uint32_t dirs = 0;
+};
+
+// Each SHITEMID we hand out starts with this, followed by the item's name. If
+// the generation matches our tar_info's, we can go straight to the item rather
+// than looking it up by name.
+
+struct tar_pidl_header {
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t index; // within tar_info::items
+};
+
+#define TAR_PIDL_MAGIC 0x50524154 // "TARP"
+
+class tar_item;
+
+struct tar_child_index {
+    std::unordered_map<std::string_view, tar_item*> names;
+    std::unordered_map<uint32_t, tar_item*> folded; // first child with each folded_hash
+};
+
 class tar_item {
 public:
     tar_item(const std::string_view& name, int64_t size, bool dir,
              const std::string_view& full_path, const std::optional<time_t>& mtime,
-             const std::string_view& user, const std::string_view& group,
-             mode_t mode, tar_item* parent) :
-        name(name), size(size), dir(dir), full_path(full_path), mtime(mtime), user(user), group(group), mode(mode), parent(parent) { }
+             const tar_owner* user, const tar_owner* group,
+             mode_t mode, tar_item* parent, int64_t header_offset, int64_t data_offset) :
+        name(name), full_path(full_path), user(user), group(group), parent(parent), size(size),
+        header_offset(header_offset), data_offset(data_offset), mtime(mtime), mode(mode), dir(dir) { }
 
-    ITEMID_CHILD* make_pidl_child() const;
-    ITEMID_CHILD* make_relative_pidl(tar_item* root) const;
+    ITEMID_CHILD* make_pidl_child(uint32_t generation) const;
+    ITEMID_CHILD* make_relative_pidl(tar_item* root, uint32_t generation) const;
     void find_child(const std::u16string_view& name, tar_item** ret);
+    tar_item* get_child(const std::string_view& name) const;
+    void add_child(tar_item* item);
     SFGAOF get_atts() const;
+    std::u16string get_type_name() const;
 
-    std::string name, full_path, user, group;
+    std::string_view name, full_path; // in tar_info's string arena
+    const tar_owner* user;
+    const tar_owner* group;
     tar_item* parent;
+    std::vector<tar_item*> children;
+    std::unique_ptr<tar_child_index> child_index; // only for big directories
+    tar_dir_totals totals; // only for directories
     int64_t size;
-    bool dir;
-    std::list<tar_item> children;
+    int64_t header_offset; // within uncompressed stream, or -1 if unknown
+    int64_t data_offset; // ditto - only set if data is stored contiguously
     std::optional<time_t> mtime;
     mode_t mode;
+    uint32_t folded_hash = 0; // hash of lowercased UTF-16 name, for find_child
+    uint32_t index = 0; // within tar_info::items
+    uint32_t child_num = 0; // within parent's children
+    bool dir;
 };
 
 enum class archive_type {
@@ -130,17 +205,316 @@ static archive_type operator|(archive_type a, archive_type b) {
     return (archive_type)((int)a | (int)b);
 }
 
+// A place in a compressed stream from which we can start decompressing. The
+// window, if any, is the preceding 32 KB of output, itself deflated to save
+// memory. For bzip2, each access point is the start of a block.
+
+struct access_point {
+    uint64_t in_offset;
+    uint64_t out_offset;
+    uint8_t bits; // number of bits of byte before in_offset which still need to be read
+    std::string window;
+};
+
+// If there's no catalog, the archive gets scanned on a background thread, and
+// items are added to the tree as they're found. Anything which looks at the
+// children of an item has to go through the functions here, which take the
+// lock and wait for the scan if need be. Items themselves don't change once
+// they've been added.
+
 class tar_info {
 public:
     tar_info(const std::filesystem::path& fn);
-
-    tar_item root;
+    ~tar_info();
+
+    size_t memory_usage() const;
+    tar_item* get_child(const tar_item& dir, const std::string_view& name);
+    tar_item* get_child(const tar_item& dir, const SHITEMID& id);
+    tar_item* find_child(tar_item& dir, const std::u16string_view& name);
+    tar_item* wait_for_child(const tar_item& dir, size_t num, bool wait = true);
+    tar_dir_totals get_totals(const tar_item& dir) const;
+    std::shared_ptr<const std::vector<uint32_t>> get_sort_ranks(const tar_item& dir, unsigned int col,
+        const std::function<std::vector<uint32_t>(const std::vector<tar_item*>&)>& func);
+    void wait();
+    bool scan_finished() const;
+    bool scan_failed() const;
+    void cancel();
+
+    std::deque<tar_item> items; // never reallocated, so pointers to items stay valid
+    tar_item& root;
+    string_arena strings;
     const std::filesystem::path archive_fn;
     enum archive_type type;
+    uint32_t generation; // different for each tar_info, for PIDLs
+    std::vector<access_point> index; // only added to by the scan thread, under the lock
+    bool index_complete = false; // set once the scan has finished successfully
+    std::deque<tar_owner> owners;
+
+    // progress of the scan, which can be read at any time
+    std::atomic<uint64_t> bytes_scanned = 0; // uncompressed
+    std::atomic<size_t> entries_found = 0;
+
+    // over all extract_sessions, so that read amplification can be worked out
+    std::atomic<uint64_t> extract_decoded = 0;
+    std::atomic<uint64_t> extract_delivered = 0;
+
+private:
+    void scan();
+    void scan_thread(const std::optional<catalog_key>& key, const std::filesystem::path& catalog_fn);
+    void notify_progress();
+    void wait_until(std::unique_lock<std::mutex>& ul, const std::function<bool()>& pred);
+    void set_priority();
+    const tar_owner* get_owner(const std::string_view& name);
+    void rank_owners();
+    void reset();
+    tar_item* add_entry(const std::string_view& fn, int64_t size, const std::optional<time_t>& mtime, bool is_dir,
+                        const std::string_view& user, const std::string_view& group, mode_t mode,
+                        int64_t header_offset, int64_t data_offset);
+    catalog_key get_catalog_key() const;
+    void save_catalog(const std::filesystem::path& fn, const catalog_key& key) const;
+
+    std::unordered_map<std::string_view, tar_owner*> owner_map;
+    size_t ranked_owners = 0;
+    std::map<std::pair<const tar_item*, unsigned int>, std::shared_ptr<const std::vector<uint32_t>>> sort_ranks;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    std::exception_ptr error;
+    uint64_t last_notify = 0;
+    std::atomic<bool> cancelled = false;
+    std::atomic<unsigned int> waiters = 0; // threads waiting for the scan
+    bool background = false; // scan thread has lowered its priority
+    std::thread scanner;
+};
+
+struct file_identity {
+    bool operator==(const file_identity&) const = default;
+
+    uint32_t volume;
+    uint64_t index;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+struct tar_info_cache_entry {
+    file_identity id;
+    std::shared_ptr<tar_info> tar;
+    size_t size;
+    bool sized; // false if archive was still being scanned when size was taken
+};
+
+class tar_info_cache {
+public:
+    std::shared_ptr<tar_info> get(const std::filesystem::path& fn);
+    void release(std::shared_ptr<tar_info>& tar);
+    void set_budget(uint64_t budget);
+
+    uint64_t hits = 0, misses = 0, evictions = 0;
+
+private:
+    void evict(std::vector<std::shared_ptr<tar_info>>& evicted);
+    void update_sizes();
+
+    std::mutex mutex;
+    std::optional<uint64_t> budget;
+    uint64_t total = 0;
+    std::list<std::pair<std::u16string, tar_info_cache_entry>> lru; // most recently used first
+    std::unordered_map<std::u16string, decltype(lru)::iterator> map;
+};
+
+extern tar_info_cache tar_cache;
+
+// decoders give us the uncompressed contents of an archive, from any offset
+
+class decoder {
+public:
+    virtual ~decoder() = default;
+
+    virtual size_t read(uint8_t* buf, size_t len) = 0;
+    virtual void seek(uint64_t off) = 0;
+    virtual std::optional<uint64_t> size() const { return std::nullopt; } // uncompressed, if known
+
+    void open_archive(struct archive* a);
+    void check_cancelled() const;
+
+    uint64_t position = 0;
+    std::string archive_buf;
+    const std::atomic<bool>* cancelled = nullptr; // if set, reads fail once this becomes true
+    const decoder* outer = nullptr; // if set, we're also cancelled when this is
+    std::mutex* index_mutex = nullptr; // if set, we're the scanner, and add to the index while holding this
+
+protected:
+    void skip_to(uint64_t off);
+};
+
+class raw_decoder : public decoder {
+public:
+    raw_decoder(const std::filesystem::path& fn);
+
+    size_t read(uint8_t* buf, size_t len);
+    void seek(uint64_t off);
+    std::optional<uint64_t> size() const;
+
+private:
+    unique_handle h;
+    uint64_t file_size;
+};
+
+class gzip_decoder : public decoder {
+public:
+    gzip_decoder(const std::filesystem::path& fn, std::vector<access_point>& index, uint64_t spacing = 0);
+    ~gzip_decoder();
+
+    size_t read(uint8_t* buf, size_t len);
+    void seek(uint64_t off);
+
+private:
+    void restart(const access_point* ap);
+    void refill();
+    void add_access_point();
+
+    unique_handle h;
+    z_stream strm;
+    std::vector<access_point>& index;
+    uint64_t spacing;
+    std::string inbuf;
+    uint64_t in_offset = 0; // file offset of end of inbuf
+    bool in_eof = false;
+    bool raw = false;
+    bool member_start = true;
+    unsigned int trailer_left = 0;
+    bool finished = false;
+};
+
+struct bz2_magic {
+    uint64_t bit;
+    bool eos;
+};
+
+struct bz2_block {
+    uint64_t start; // in bits
+    uint64_t end; // ditto, or 0 if not yet known
+    uint64_t out_offset; // in the decompressed stream, or UINT64_MAX if not yet known
+};
+
+struct bz2_block_data {
+    std::optional<std::string> data;
+    uint64_t end;
+};
+
+class bz2_decoder : public decoder {
+public:
+    bz2_decoder(const std::filesystem::path& fn, std::vector<access_point>& index, bool index_complete = false,
+                const std::atomic<bool>* cancelled = nullptr);
+
+    size_t read(uint8_t* buf, size_t len);
+    void seek(uint64_t off);
 
 private:
-    void add_entry(const std::string_view& fn, int64_t size, const std::optional<time_t>& mtime, bool is_dir,
-                   const char* user, const char* group, mode_t mode);
+    void find_blocks(size_t num);
+    bool next_block();
+
+    unique_handle h;
+    std::vector<access_point>& index;
+    std::vector<bz2_block> blocks;
+    std::optional<bz2_magic> next_magic; // first one after the blocks we know about
+    size_t block_num = 0; // next block to be returned
+    size_t queued = 0; // next block to be queued for decompression
+    size_t known_offsets = 0; // number of blocks whose out_offset we know
+    unsigned int threads;
+    unsigned int readahead = 1;
+    std::deque<std::future<bz2_block_data>> pending;
+    std::string block;
+    size_t block_off = 0;
+};
+
+struct xz_block {
+    uint64_t compressed_offset;
+    uint64_t unpadded_size;
+    uint64_t total_size;
+    uint64_t uncompressed_offset;
+    uint64_t uncompressed_size;
+    lzma_check check;
+};
+
+class xz_decoder : public decoder {
+public:
+    xz_decoder(const std::filesystem::path& fn);
+    ~xz_decoder();
+
+    size_t read(uint8_t* buf, size_t len);
+    void seek(uint64_t off);
+    std::optional<uint64_t> size() const;
+
+private:
+    void read_index();
+    void start_block();
+    bool next_block();
+
+    unique_handle h;
+    lzma_index* idx = nullptr;
+    lzma_index_iter iter;
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_block block_info; // liblzma keeps a pointer to this while decoding the block
+    std::string inbuf;
+    uint64_t in_offset = 0;
+    bool in_block = false;
+    bool finished = false;
+
+    // only used if we're decompressing several blocks at once
+    std::vector<xz_block> blocks;
+    size_t block_num = 0; // next block to be returned
+    size_t queued = 0; // next block to be queued for decompression
+    unsigned int readahead = 1;
+    unsigned int max_readahead = 1;
+    std::deque<std::future<std::string>> pending;
+    std::string block;
+    size_t block_off = 0;
+};
+
+// Runs another decoder on a thread of its own, so that decompression carries
+// on while the caller is busy with what we've already given it.
+
+#define READAHEAD_BLOCK_SIZE 1048576
+#define READAHEAD_BLOCKS 4
+
+class readahead_decoder : public decoder {
+public:
+    readahead_decoder(std::unique_ptr<decoder> inner, uint64_t end = UINT64_MAX);
+    ~readahead_decoder();
+
+    size_t read(uint8_t* buf, size_t len);
+    void seek(uint64_t off);
+    std::optional<uint64_t> size() const;
+
+private:
+    void start();
+    void stop();
+    void produce();
+
+    std::unique_ptr<decoder> inner; // only touched by producer thread while it's running
+    uint64_t end; // where to stop reading ahead
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> blocks; // decompressed, waiting to be read
+    std::vector<std::string> spare; // finished with, kept so we're not always allocating
+    std::string current;
+    size_t current_off = 0;
+    bool eof = false;
+    std::exception_ptr error;
+    std::atomic<bool> stopping = false;
+    std::thread producer;
+
+    // a big read, which the producer decompresses straight into the caller's buffer
+    enum class direct_state {
+        none,
+        requested,
+        taken,
+        done
+    } direct = direct_state::none;
+    uint8_t* direct_buf = nullptr;
+    size_t direct_len = 0;
+    size_t direct_read = 0;
 };
 
 class factory : public IClassFactory {
@@ -240,12 +614,13 @@ typedef struct {
     std::function<int(const tar_item&, const tar_item&)> compare_func;
     SHCOLSTATEF state;
     bool tarball_only;
+    std::function<std::u16string(const tar_item&)> sort_key; // if compare_func is slow
 } header_info;
 
 class shell_enum : public IEnumIDList {
 public:
     shell_enum(const std::shared_ptr<tar_info>& tar, tar_item* root, SHCONTF flags) :
-        tar(tar), root(root), flags(flags), it(root->children.begin()) { }
+        tar(tar), root(root), flags(flags) { }
 
     // IUnknown
 
@@ -265,7 +640,7 @@ private:
     std::shared_ptr<tar_info> tar;
     tar_item* root;
     LONG refcount = 0;
-    decltype(root->children.begin()) it;
+    size_t pos = 0; // index into root->children
 };
 
 class shell_item_details {
@@ -276,6 +651,8 @@ public:
     std::u16string relative_path;
 };
 
+class extract_session;
+
 class shell_item_list : public IContextMenu, public IDataObject {
 public:
     shell_item_list(PIDLIST_ABSOLUTE root_pidl, const std::shared_ptr<tar_info>& tar,
@@ -328,6 +705,7 @@ private:
     std::shared_ptr<tar_info> tar;
     std::vector<tar_item*> itemlist;
     std::vector<shell_item_details> full_itemlist;
+    std::shared_ptr<extract_session> session;
     CLIPFORMAT cf_shell_id_list, cf_file_contents, cf_file_descriptor;
     tar_item* root;
     bool recursive;
@@ -365,9 +743,65 @@ private:
     unsigned int index = 0;
 };
 
+// Streams for lots of files in the same archive, e.g. when they're dragged out
+// of a folder, share one of these. It makes one pass through the archive,
+// handing over the data of each entry when it gets to it. If we're asked for
+// an entry further on, the ones in between that will be wanted later get put
+// aside - in memory if they're small, or in a temporary file if not.
+
+enum class extract_state {
+    pending,
+    current,
+    spilled,
+    gone
+};
+
+struct extract_entry {
+    extract_state state = extract_state::pending;
+    uint64_t size;
+    uint64_t consumed = 0; // if current, how much we've read from the archive
+    uint64_t spill_start = 0; // if spilled, offset within file of what we kept
+    uint64_t spill_length = 0;
+    std::string spill_data; // if spilled to memory
+    std::optional<uint64_t> spill_offset; // if spilled to file, offset within it
+};
+
+class extract_session {
+public:
+    extract_session(const std::shared_ptr<tar_info>& tar, const std::vector<tar_item*>& items);
+    ~extract_session();
+
+    std::optional<size_t> read(const tar_item& item, uint64_t offset, uint8_t* buf, size_t len);
+    void release(const tar_item& item);
+
+    // read amplification is bytes_decoded / bytes_delivered
+    uint64_t bytes_decoded = 0;
+    uint64_t bytes_delivered = 0;
+
+private:
+    bool advance_to(const tar_item& item);
+    void spill_current();
+    void drop(extract_entry& ent);
+    size_t read_archive(uint8_t* buf, size_t len);
+    size_t read_spill(extract_entry& ent, uint64_t offset, uint8_t* buf, size_t len);
+
+    std::mutex mutex;
+    std::shared_ptr<tar_info> tar;
+    std::unordered_map<int64_t, extract_entry> entries; // by header offset
+    std::vector<access_point> index;
+    std::unique_ptr<decoder> dec;
+    struct archive* a = nullptr;
+    extract_entry* current = nullptr;
+    bool archive_done = false;
+    unique_handle spill_file;
+    uint64_t spill_file_size = 0;
+    uint64_t spill_memory = 0;
+};
+
 class tar_item_stream : public IStream {
 public:
     tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item& item);
+    tar_item_stream(const std::shared_ptr<tar_info>& tar, tar_item& item, const std::shared_ptr<extract_session>& session);
     ~tar_item_stream();
 
     // IUnknown
@@ -398,18 +832,18 @@ public:
 private:
     LONG refcount = 0;
     struct archive* a = nullptr;
+    std::shared_ptr<tar_info> tar;
     tar_item& item;
-    std::string buf;
-    gzFile gzf = nullptr;
-    unique_handle h;
-    lzma_stream xz_strm = LZMA_STREAM_INIT;
-    bz_stream bz2_strm;
-    std::string inbuf, outbuf;
+    std::span<const uint8_t> pending; // rest of libarchive's last block, valid until we ask for the next one
     enum archive_type type;
-    bool eof = false;
-    int lzma_ret = LZMA_OK;
-    int bz2_ret = BZ_OK;
     uint64_t position = 0;
+    std::vector<access_point> own_index; // used instead of tar->index while archive is being scanned
+    std::unique_ptr<decoder> dec; // after own_index, as it may still be using it when we're freed
+    std::shared_ptr<extract_session> session;
+
+    void open();
+    void skip(uint64_t len);
+    void seek_to(uint64_t pos);
 };
 
 class shell_context_menu;
@@ -576,3 +1010,16 @@ std::u16string mode_to_u16string(mode_t m);
 
 // tarfldr.cpp
 enum archive_type identify_file_type(const std::u16string_view& fn2);
+uint32_t get_setting(const std::u16string& name, uint32_t def);
+
+// decoder.cpp
+DWORD read_at(HANDLE h, uint64_t off, void* buf, DWORD len);
+std::unique_ptr<decoder> open_decoder(const std::filesystem::path& fn, archive_type type,
+                                      std::vector<access_point>& index, uint64_t spacing = 0,
+                                      bool index_complete = false, const std::atomic<bool>* cancelled = nullptr);
+archive_type detect_compression(const std::filesystem::path& fn, archive_type type);
+unsigned int xz_threads();
+uint64_t xz_memory_limit();
+
+// item.cpp
+std::filesystem::path get_temp_file_name(const std::filesystem::path& dir, const std::u16string& prefix, unsigned int unique);